@@ -18,8 +18,12 @@ fi
 
 cd "$WORK_DIR" || exit
 
-CONFIG_BLOCK_SZ=512
-BLOCK_COUNT=8192
+# 设备大小与IO单位可由 DDRIVER_DISK_SZ / DDRIVER_IO_SZ 指定，支持K/M/G后缀
+# 内核设备可用 DDRIVER_BLKDEV=1 同时注册blk-mq块设备 /dev/ddriverb
+# 延迟模型与用户态相同，由 DDRIVER_PROFILE、DDRIVER_READ_LAT 等指定，DDRIVER_VCLOCK=1 时不真正等待
+CONFIG_BLOCK_SZ=$(numfmt --from=iec "${DDRIVER_IO_SZ:-512}")
+CONFIG_DISK_SZ=$(numfmt --from=iec "${DDRIVER_DISK_SZ:-4M}")
+BLOCK_COUNT=$((CONFIG_DISK_SZ / CONFIG_BLOCK_SZ))
 
 
 function usage(){
@@ -80,7 +84,10 @@ function install() {
         sudo rm $KERNEL_DEV_PATH>/dev/null 2>&1 
         sudo rmmod ddriver>/dev/null 2>&1 
         sudo dmesg -C
-        sudo insmod ./ddriver.ko
+        sudo insmod ./ddriver.ko disk_size="$CONFIG_DISK_SZ" block_size="$CONFIG_BLOCK_SZ" blkdev="${DDRIVER_BLKDEV:-0}" \
+            profile="${DDRIVER_PROFILE:-hdd}" vclock="${DDRIVER_VCLOCK:-0}" track_num="${DDRIVER_TRACK_NUM:-100}" \
+            read_lat="${DDRIVER_READ_LAT:--1}" write_lat="${DDRIVER_WRITE_LAT:--1}" \
+            seek_lat="${DDRIVER_SEEK_LAT:--1}" xfer_bw="${DDRIVER_XFER_BW:--1}"
         in=$(dmesg | tail -n 1)
         tokens=("$in")
         major_number=${tokens[${#tokens[*]}-1]}
@@ -136,6 +143,7 @@ function test(){
 function log() {
     if [ "$DDRIVER_TYPE" == "k" ]; then  
         dmesg | grep ddriver
+        sudo cat /sys/kernel/debug/ddriver/stats 2>/dev/null
     else 
         cat "$USER_LOG_PATH"
     fi
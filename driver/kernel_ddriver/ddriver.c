@@ -2,6 +2,24 @@
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/xarray.h>
+#include <linux/moduleparam.h>
+#include <linux/version.h>
+#include <linux/uio.h>
+#include <linux/atomic.h>
+#include <linux/rcupdate.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/highmem.h>
+#include <linux/hrtimer.h>
+#include <linux/delay.h>
+#include <linux/sched.h>
+#include <linux/math64.h>
 #include <asm/uaccess.h>
 #include <linux/uaccess.h>
 #include "ddriver_ctl.h"
@@ -27,23 +45,38 @@
                         "filp_open/cpp-filp_open-function-examples.html>"
 #define DRIVER_VERSION  "0.1.0"
 
-#define CONFIG_DISK_SZ  (4 * 1024 * 1024)
+#define CONFIG_DISK_SZ  "4M"
 #define CONFIG_BLOCK_SZ (512)
+#define CONFIG_BLK_QUEUE_DEPTH  64
+#define CONFIG_BATCH_MAX        1024
+#define CONFIG_PROFILE          "hdd"                 /* Default device profile, as the user driver */
+#define CONFIG_TRACK_NUM        100
+#define CONFIG_SEEK_POINTS      8                     /* Max points of a seek curve */
+#define CONFIG_SPIN_US          50                    /* Shorter delays busy-wait: a timer wakeup 
+                                                         costs about as much */
+/* blk_mq_alloc_disk appeared in 5.15, older kernels only have the chardev */
+#define HAS_BLK_MQ_DISK (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0))
 /******************************************************************************
 * SECTION: Macro Functions 
 *******************************************************************************/
 #define IGNORE_ARG(arg)         ((void)arg)
-#define IS_ADDR_ALIGN(addr)     (addr % CONFIG_BLOCK_SZ == 0)
-#define ADDR_ROUND_UP(addr)     ((addr / CONFIG_BLOCK_SZ) * CONFIG_BLOCK_SZ)
+#define IS_ADDR_ALIGN(addr)     (((addr) & (disk.iounit_size - 1)) == 0)
+#define ADDR_ROUND_UP(addr)     ((addr) & ~((long long)disk.iounit_size - 1))
 
-#define GET_HEAD_POS(disk)      (disk.head - disk.layout)
-#define FORWARD_HEAD(disk, dis) (disk.head += dis)
-#define SET_HEAD(disk, ofs)     (disk.head = disk.layout + ofs)
+#define GET_HEAD_POS(disk)      (atomic64_read(&disk.head))
+#define FORWARD_HEAD(disk, dis) (atomic64_add(dis, &disk.head))
+#define SET_HEAD(disk, ofs)     (atomic64_set(&disk.head, ofs))
+#define MOVE_HEAD(disk, ofs)    (atomic64_xchg(&disk.head, ofs))
 #define RESET_HEAD(disk)        (SET_HEAD(disk, 0))
 
-#define INC_READCNT(disk)       (disk.read_cnt++)
-#define INC_WRITECNT(disk)      (disk.write_cnt++)
-#define INC_SEEKCNT(disk)       (disk.seek_cnt++)
+#define INC_SEEKCNT(disk)       (atomic64_inc(&disk.seek_cnt))
+#define STAT_READ(val)          (atomic64_read(&(val)))
+#define OP_STAT(op)             ((op) == DDRIVER_OP_WRITE ? &disk.write : &disk.read)
+
+#define XFER_DELAY(bytes)       (div_u64(bytes, disk.xfer_bw))
+#define RW_LAT_US(op, bytes)                                                \
+        (((op) == DDRIVER_OP_WRITE ? disk.write_lat : disk.read_lat) +      \
+         XFER_DELAY(bytes))
 /******************************************************************************
 * SECTION: Kernel Module Template
 *******************************************************************************/
@@ -51,178 +84,829 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR(DRIVER_AUTHOR);	    
 MODULE_DESCRIPTION(DRIVER_DESC);	
 MODULE_VERSION(DRIVER_VERSION);	
+
+static char *disk_size = CONFIG_DISK_SZ;
+module_param(disk_size, charp, 0444);
+MODULE_PARM_DESC(disk_size, "Disk size, K/M/G suffix allowed (default " CONFIG_DISK_SZ ")");
+
+static int block_size = CONFIG_BLOCK_SZ;
+module_param(block_size, int, 0444);
+MODULE_PARM_DESC(block_size, "IO unit in bytes, a power of 2, at least 512 (default 512)");
+
+static bool blkdev = false;
+module_param(blkdev, bool, 0444);
+MODULE_PARM_DESC(blkdev, "Also expose the disk as blk-mq block device /dev/" DEVICE_NAME "b");
+
+static char *profile = CONFIG_PROFILE;
+module_param(profile, charp, 0444);
+MODULE_PARM_DESC(profile, "Latency profile: hdd, hdd7200, sata-ssd, nvme, ram (default " CONFIG_PROFILE ")");
+
+static int read_lat = -1;
+module_param(read_lat, int, 0444);
+MODULE_PARM_DESC(read_lat, "Per read overhead in us, -1 takes the profile's");
+
+static int write_lat = -1;
+module_param(write_lat, int, 0444);
+MODULE_PARM_DESC(write_lat, "Per write overhead in us, -1 takes the profile's");
+
+static int seek_lat = -1;
+module_param(seek_lat, int, 0444);
+MODULE_PARM_DESC(seek_lat, "Rotation in us per revolution, -1 takes the profile's");
+
+static int xfer_bw = -1;
+module_param(xfer_bw, int, 0444);
+MODULE_PARM_DESC(xfer_bw, "Transfer rate in MB/s, -1 takes the profile's");
+
+static int track_num = CONFIG_TRACK_NUM;
+module_param(track_num, int, 0444);
+MODULE_PARM_DESC(track_num, "Tracks of the disk (default 100)");
+
+static bool vclock = false;
+module_param(vclock, bool, 0444);
+MODULE_PARM_DESC(vclock, "Advance a virtual clock instead of waiting out the latency");
 /******************************************************************************
 * SECTION: Type definitions
 *******************************************************************************/
+struct ddriver_seek_point
+{
+    int permille;                                     /* Seek distance, per mille of full stroke */
+    int lat;                                          /* Seek latency at that distance, us */
+};
+
+struct ddriver_profile
+{
+    char name[DDRIVER_NAME_LEN];
+    int  read_lat;                                    /* Per request overhead, us */
+    int  write_lat;
+    int  seek_lat;                                    /* Rotation, us per 360 degree */
+    int  xfer_bw;                                     /* MB/s */
+    int  queue_depth;                                 /* Reported only, requests never queue */
+    int  seek_points;                                 /* 0: no arm movement cost */
+    struct ddriver_seek_point seek_curve[CONFIG_SEEK_POINTS];
+};
+
+struct ddriver_kstat                                  /* One op, laid out as ddriver_op_stat */
+{
+    atomic64_t cnt;                                   /* Requests */
+    atomic64_t blks;                                  /* Device blocks moved */
+    atomic64_t bytes;
+    atomic64_t seq_cnt;                               /* Started where the head was */
+    atomic64_t rand_cnt;
+    atomic64_t lat_us;                                /* Emulated service time */
+    atomic64_t lat_hist[DDRIVER_HIST_BUCKETS];        /* log2 buckets of lat_us */
+};
+
 struct ddriver
 {
-    char layout[CONFIG_DISK_SZ];                      /* Disk Layout */
-    char *head;                                       /* Disk Head */
-    int  read_cnt;
-    int  write_cnt;
-    int  seek_cnt;
+    struct xarray pages;                              /* Disk Layout, page index -> page, 
+                                                         allocated on first write */
+    struct address_space mapping;                     /* Shared by every opener's mmap */
+    atomic64_t head;                                  /* Disk Head, where the last I/O ended */
+    struct ddriver_kstat read;                        /* Statistics of current epoch */
+    struct ddriver_kstat write;
+    atomic64_t seek_cnt;
+    atomic64_t seek_dist_hist[DDRIVER_HIST_BUCKETS];  /* log2 buckets, in blocks */
+    atomic64_t epoch;
+    atomic64_t epoch_us;
+    atomic64_t service_us;                            /* Accumulated emulated service time */
+    atomic64_t vclock_us;                             /* Virtual clock, see vclock */
+    u64  open_us;                                     /* Device clock at load */
+    const struct ddriver_profile *profile;            /* Seek curve */
+    int  read_lat;
+    int  write_lat;
+    int  seek_lat;
+    int  xfer_bw;
+    int  track_num;
     int  major_num;
-    int  open_count;
-    int  layout_size;
+    atomic_t open_count;                              /* Openers, any number at once */
+    long long layout_size;
     int  iounit_size;
+    struct dentry *debugfs;                           /* <debugfs>/ddriver */
+    int  blk_major;                                   /* Block device, 0 if not registered */
+    struct blk_mq_tag_set tag_set;
+    struct gendisk *gd;
 };
 
 static struct ddriver disk = {
-    .head        = NULL,
-    .read_cnt    = 0,
-    .write_cnt   = 0,
-    .seek_cnt    = 0,
+    .pages       = XARRAY_INIT(disk.pages, 0),
+    .head        = ATOMIC64_INIT(0),
+    .seek_cnt    = ATOMIC64_INIT(0),
     .major_num   = 0,
-    .open_count  = 0,
-    .layout_size = CONFIG_DISK_SZ,
+    .open_count  = ATOMIC_INIT(0),
+    .layout_size = 0,
     .iounit_size = CONFIG_BLOCK_SZ
 };
+
+/* 
+ * Built-in profiles, the same as the user driver's, so that both report 
+ * the same latencies. "hdd" is the original model: rotation cost only.
+ */
+static const struct ddriver_profile profiles[] = {
+    {
+        .name = "hdd",       .read_lat = 2000, .write_lat = 1000, .seek_lat = 4170,
+        .xfer_bw = 100,      .queue_depth = 1, .seek_points = 0
+    },
+    {
+        .name = "hdd7200",   .read_lat = 100,  .write_lat = 100,  .seek_lat = 8330,
+        .xfer_bw = 150,      .queue_depth = 1, .seek_points = 4,
+        .seek_curve = { {0, 800}, {100, 4000}, {333, 8500}, {1000, 15000} }
+    },
+    {
+        .name = "sata-ssd",  .read_lat = 90,   .write_lat = 60,   .seek_lat = 0,
+        .xfer_bw = 500,      .queue_depth = 32, .seek_points = 0
+    },
+    {
+        .name = "nvme",      .read_lat = 20,   .write_lat = 15,   .seek_lat = 0,
+        .xfer_bw = 3000,     .queue_depth = 64, .seek_points = 0
+    },
+    {
+        .name = "ram",       .read_lat = 0,    .write_lat = 0,    .seek_lat = 0,
+        .xfer_bw = 10000,    .queue_depth = 64, .seek_points = 0
+    }
+};
 /******************************************************************************
 * SECTION: Helper Functions
 *******************************************************************************/
-int check_valid(size_t size){
-    if (GET_HEAD_POS(disk) >=  CONFIG_DISK_SZ) {
+/**
+ * @brief 检查[pos, pos + size)是否为设备内按IO单位对齐的范围
+ * 
+ * @param pos           Start, aligned to the IO unit
+ * @param size          Multiple of the IO unit
+ * @return int          0 if valid
+ */
+int check_valid(loff_t pos, size_t size){
+    if (pos < 0 || pos >= disk.layout_size) {
         kernel_alert("disk head reach the end");
         return -EINVAL;
     }
-    if (size != CONFIG_BLOCK_SZ){
-        kernel_alert("io size %ld should align to %d", size, CONFIG_BLOCK_SZ);
+    if (!IS_ADDR_ALIGN(pos) || !IS_ADDR_ALIGN(size) || size == 0){
+        kernel_alert("io size %ld at %lld should align to %d", size, pos, disk.iounit_size);
         return -EIO;
     }
     return 0;
 }
+static u64 dev_now(void) {
+    return vclock ? atomic64_read(&disk.vclock_us) : div_u64(ktime_get_ns(), NSEC_PER_USEC);
+}
+/**
+ * @brief 等待模拟的服务时间。短延迟忙等，长延迟用零余量的hrtimer睡眠，
+ *        均精确到us；vclock时只推进虚拟时钟
+ * 
+ * @param us            Emulated service time
+ */
+static void emulate_delay(u64 us) {
+    ktime_t expires;
+
+    if (us == 0)
+        return;
+    if (vclock) {
+        atomic64_add(us, &disk.vclock_us);
+        return;
+    }
+    if (us <= CONFIG_SPIN_US) {
+        udelay(us);
+        return;
+    }
+    expires = ns_to_ktime(us * NSEC_PER_USEC);
+    set_current_state(TASK_UNINTERRUPTIBLE);
+    schedule_hrtimeout(&expires, HRTIMER_MODE_REL);
+}
+
+static int log2_bucket(u64 val) {
+    int bucket = fls64(val);                          /* [2^(b-1), 2^b) */
+    return bucket < DDRIVER_HIST_BUCKETS ? bucket : DDRIVER_HIST_BUCKETS - 1;
+}
+
+static int arm_lat_us(s64 tracks) {
+    const struct ddriver_seek_point *curve = disk.profile->seek_curve;
+    int n = disk.profile->seek_points;
+    s64 x = tracks * 1000;                            /* permille * track_num */
+    s64 x0, x1;
+    int i;
+
+    if (tracks == 0 || n == 0)
+        return 0;
+    if (x >= (s64)curve[n - 1].permille * disk.track_num)
+        return curve[n - 1].lat;
+    for (i = 1; i < n; i++) {                         /* Linear interpolation */
+        x0 = (s64)curve[i - 1].permille * disk.track_num;
+        x1 = (s64)curve[i].permille * disk.track_num;
+        if (x < x1) {
+            return curve[i - 1].lat + 
+                   div64_s64((s64)(curve[i].lat - curve[i - 1].lat) * (x - x0), x1 - x0);
+        }
+    }
+    return curve[0].lat;                              /* Track-to-track minimum */
+}
+
+static int rotate_lat_us(loff_t start, loff_t end) {
+    s64 bytes_per_track = div_s64(disk.layout_size, disk.track_num);
+    s64 dist = abs(end - start);
+    s64 distance = dist - div64_s64(dist, bytes_per_track) * bytes_per_track;
+    s64 tracks = abs(div64_s64(end, bytes_per_track) - div64_s64(start, bytes_per_track));
+
+    return arm_lat_us(tracks) + div64_s64(distance * disk.seek_lat, bytes_per_track);
+}
+
+static u64 model_seek(loff_t start, loff_t end) {
+    if (start == end)
+        return 0;
+    INC_SEEKCNT(disk);
+    atomic64_inc(&disk.seek_dist_hist[log2_bucket(div_u64(abs(end - start), disk.iounit_size))]);
+    return rotate_lat_us(start, end);
+}
+/**
+ * @brief 按延迟模型计算一次请求的服务时间并记入统计，磁头移到请求末尾。
+ *        与用户态ddriver的model_io相同，无锁，可并发调用；不睡眠，调用者随后emulate_delay
+ * 
+ * @param op            DDRIVER_OP_READ or DDRIVER_OP_WRITE
+ * @param pos           Start
+ * @param size          Bytes, whole blocks
+ * @return u64          Service time, us
+ */
+static u64 model_io(int op, loff_t pos, size_t size) {
+    struct ddriver_kstat *st = OP_STAT(op);
+    loff_t cur = MOVE_HEAD(disk, pos + size);
+    u64 lat = model_seek(cur, pos) + RW_LAT_US(op, size);
+
+    atomic64_inc(&st->cnt);
+    atomic64_add(size / disk.iounit_size, &st->blks);
+    atomic64_add(size, &st->bytes);
+    atomic64_inc(cur == pos ? &st->seq_cnt : &st->rand_cnt);
+    atomic64_add(lat, &st->lat_us);
+    atomic64_inc(&st->lat_hist[log2_bucket(lat)]);
+    atomic64_add(lat, &disk.service_us);
+    return lat;
+}
+
+static void stat_fill(struct ddriver_op_stat *out, struct ddriver_kstat *st) {
+    unsigned long long *dst = (unsigned long long *)out;
+    atomic64_t *src = (atomic64_t *)st;
+    int i;
+
+    BUILD_BUG_ON(sizeof(struct ddriver_kstat) != sizeof(struct ddriver_op_stat));
+    for (i = 0; i < sizeof(struct ddriver_op_stat) / sizeof(unsigned long long); i++)
+        dst[i] = atomic64_read(&src[i]);
+}
+
+static void stat_merge(struct ddriver_state_v2 *out) {
+    int i;
+
+    out->epoch    = STAT_READ(disk.epoch);
+    out->epoch_us = STAT_READ(disk.epoch_us);
+    out->seek_cnt = STAT_READ(disk.seek_cnt);
+    for (i = 0; i < DDRIVER_HIST_BUCKETS; i++)
+        out->seek_dist_hist[i] = STAT_READ(disk.seek_dist_hist[i]);
+    stat_fill(&out->read, &disk.read);
+    stat_fill(&out->write, &disk.write);
+}
+/**
+ * @brief 开始新的统计epoch：清零全部计数，不改变数据与磁头
+ */
+static void new_epoch(void) {
+    atomic64_t *words;
+    int i;
+
+    words = (atomic64_t *)&disk.read;
+    for (i = 0; i < sizeof(struct ddriver_kstat) / sizeof(atomic64_t); i++)
+        atomic64_set(&words[i], 0);
+    words = (atomic64_t *)&disk.write;
+    for (i = 0; i < sizeof(struct ddriver_kstat) / sizeof(atomic64_t); i++)
+        atomic64_set(&words[i], 0);
+    for (i = 0; i < DDRIVER_HIST_BUCKETS; i++)
+        atomic64_set(&disk.seek_dist_hist[i], 0);
+    atomic64_set(&disk.seek_cnt, 0);
+    atomic64_inc(&disk.epoch);
+    atomic64_set(&disk.epoch_us, dev_now() - disk.open_us);
+}
+/**
+ * @brief 按profile与模块参数设置延迟模型，参数为-1时取profile的值
+ * 
+ * @return int          0 or -EINVAL
+ */
+static int load_geometry(void) {
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(profiles); i++) {
+        if (strcmp(profiles[i].name, profile) == 0)
+            disk.profile = &profiles[i];
+    }
+    if (disk.profile == NULL) {
+        kernel_alert("unknown device profile: %s", profile);
+        return -EINVAL;
+    }
+    disk.read_lat  = read_lat  >= 0 ? read_lat  : disk.profile->read_lat;
+    disk.write_lat = write_lat >= 0 ? write_lat : disk.profile->write_lat;
+    disk.seek_lat  = seek_lat  >= 0 ? seek_lat  : disk.profile->seek_lat;
+    disk.xfer_bw   = xfer_bw   >= 0 ? xfer_bw   : disk.profile->xfer_bw;
+    disk.track_num = track_num;
+    if (disk.xfer_bw <= 0 || disk.track_num <= 0 || disk.track_num > disk.layout_size) {
+        kernel_alert("invalid latency model");
+        return -EINVAL;
+    }
+    return 0;
+}
+/**
+ * @brief debugfs的stats文件，每行一个“名字 值”，读取无需打开设备。
+ *        seek_cnt只统计IO引起的磁头移动，llseek不计入
+ */
+static int stats_show(struct seq_file *m, void *data) {
+    IGNORE_ARG(data);
+    seq_printf(m, "disk_size %lld\n", disk.layout_size);
+    seq_printf(m, "iounit_size %d\n", disk.iounit_size);
+    seq_printf(m, "open_count %d\n", atomic_read(&disk.open_count));
+    seq_printf(m, "profile %s\n", disk.profile->name);
+    seq_printf(m, "epoch %lld\n", STAT_READ(disk.epoch));
+    seq_printf(m, "service_us %lld\n", STAT_READ(disk.service_us));
+    seq_printf(m, "read_cnt %lld\n", STAT_READ(disk.read.cnt));
+    seq_printf(m, "read_blks %lld\n", STAT_READ(disk.read.blks));
+    seq_printf(m, "read_bytes %lld\n", STAT_READ(disk.read.bytes));
+    seq_printf(m, "read_seq_cnt %lld\n", STAT_READ(disk.read.seq_cnt));
+    seq_printf(m, "read_rand_cnt %lld\n", STAT_READ(disk.read.rand_cnt));
+    seq_printf(m, "read_lat_us %lld\n", STAT_READ(disk.read.lat_us));
+    seq_printf(m, "write_cnt %lld\n", STAT_READ(disk.write.cnt));
+    seq_printf(m, "write_blks %lld\n", STAT_READ(disk.write.blks));
+    seq_printf(m, "write_bytes %lld\n", STAT_READ(disk.write.bytes));
+    seq_printf(m, "write_seq_cnt %lld\n", STAT_READ(disk.write.seq_cnt));
+    seq_printf(m, "write_rand_cnt %lld\n", STAT_READ(disk.write.rand_cnt));
+    seq_printf(m, "write_lat_us %lld\n", STAT_READ(disk.write.lat_us));
+    seq_printf(m, "seek_cnt %lld\n", STAT_READ(disk.seek_cnt));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+/**
+ * @brief 取得第idx页并持有一个引用，用完后put_page。页在第一次写入时才分配，
+ *        未分配的页读出为0，因此GB级的设备只占用写过的内存。
+ *        xarray自身持有每页的一个引用；并发的DISCARD摘除页后，
+ *        正在拷贝的读写者仍持有引用，页在最后一个引用释放时才回收。
+ *        查找不加锁，按页缓存的方式投机取引用后复查
+ * 
+ * @param idx           Page index
+ * @param alloc         Allocate if absent
+ * @return struct page* NULL if absent (or no memory when alloc)
+ */
+static struct page *disk_get_page(pgoff_t idx, bool alloc) {
+    struct page *page;
+    struct page *old;
+
+    rcu_read_lock();
+    do {
+        page = xa_load(&disk.pages, idx);
+        if (page == NULL)
+            break;
+        if (!get_page_unless_zero(page))              /* Being freed, look again */
+            continue;
+        if (xa_load(&disk.pages, idx) == page)
+            break;
+        put_page(page);                               /* Discarded (and reused) meanwhile */
+    } while (1);
+    rcu_read_unlock();
+    if (page != NULL || !alloc)
+        return page;
+
+    page = alloc_page(GFP_NOIO | __GFP_ZERO);         /* The reference of the xarray; NOIO
+                                                         as the block device writes here */
+    if (page == NULL)
+        return NULL;
+    get_page(page);                                   /* The reference of the caller */
+    old = xa_cmpxchg(&disk.pages, idx, NULL, page, GFP_NOIO);
+    if (old != NULL) {                                /* Lost the race, or no memory */
+        put_page(page);
+        put_page(page);
+        return xa_is_err(old) ? NULL : disk_get_page(idx, false);
+    }
+    return page;
+}
+/**
+ * @brief 从设备ofs处读出len字节到iter，可跨页
+ * 
+ * @return ssize_t      Bytes copied, -EFAULT if none
+ */
+static ssize_t disk_copy_to_iter(struct iov_iter *iter, loff_t ofs, size_t len) {
+    struct page *page;
+    size_t pofs, chunk, copied;
+    ssize_t done = 0;
+
+    while (len > 0) {
+        pofs   = offset_in_page(ofs);
+        chunk  = min_t(size_t, len, PAGE_SIZE - pofs);
+        page   = disk_get_page(ofs >> PAGE_SHIFT, false);
+        copied = page == NULL ? iov_iter_zero(chunk, iter) : 
+                                copy_page_to_iter(page, pofs, chunk, iter);
+        if (page != NULL)
+            put_page(page);
+        done  += copied;
+        if (copied < chunk)
+            break;
+        ofs += chunk;
+        len -= chunk;
+    }
+    return done > 0 ? done : -EFAULT;
+}
+/**
+ * @brief 将iter中的len字节写入设备ofs处，按需分配页
+ * 
+ * @return ssize_t      Bytes copied, negative if none
+ */
+static ssize_t disk_copy_from_iter(loff_t ofs, struct iov_iter *iter, size_t len) {
+    struct page *page;
+    size_t pofs, chunk, copied;
+    ssize_t done = 0;
+
+    while (len > 0) {
+        pofs  = offset_in_page(ofs);
+        chunk = min_t(size_t, len, PAGE_SIZE - pofs);
+        page  = disk_get_page(ofs >> PAGE_SHIFT, true);
+        if (page == NULL)
+            return done > 0 ? done : -ENOMEM;
+        copied = copy_page_from_iter(page, pofs, chunk, iter);
+        put_page(page);
+        done  += copied;
+        if (copied < chunk)
+            break;
+        ofs += chunk;
+        len -= chunk;
+    }
+    return done > 0 ? done : -EFAULT;
+}
+/**
+ * @brief 一次读写请求：从pos起读写iter中的全部整块，超出设备的部分截断。
+ *        read_iter、write_iter与批量ioctl共用，先按延迟模型等待再搬运数据
+ * 
+ * @param op            DDRIVER_OP_READ or DDRIVER_OP_WRITE
+ * @param pos           Aligned to the IO unit
+ * @param iter          User buffers, total a multiple of the IO unit
+ * @return ssize_t      Bytes moved, 0 when reading at the end of disk
+ */
+static ssize_t disk_rw(int op, loff_t pos, struct iov_iter *iter) {
+    size_t size = iov_iter_count(iter);
+    ssize_t ret;
+
+    if (size == 0)
+        return 0;
+    if (pos == disk.layout_size)
+        return op == DDRIVER_OP_WRITE ? -ENOSPC : 0;
+    ret = check_valid(pos, size);
+    if (ret < 0)
+        return ret;
+    size = min_t(loff_t, size, disk.layout_size - pos);
+    emulate_delay(model_io(op, pos, size));
+    if (op == DDRIVER_OP_WRITE)
+        ret = disk_copy_from_iter(pos, iter, size);
+    else
+        ret = disk_copy_to_iter(iter, pos, size);
+    if (ret < 0)
+        return ret;
+    return ADDR_ROUND_UP(ret);                        /* Whole blocks only, a torn one failed */
+}
+/**
+ * @brief 批量读写：在一次ioctl内依次执行用户的请求数组，每项结果写回res，
+ *        某项失败不影响其余各项。FUA位被忽略，内核设备没有写缓存
+ * 
+ * @param ubatch        User's ddriver_batch, done is written back
+ * @return long         0, or -errno if the array itself is unusable
+ */
+static long disk_batch(struct ddriver_batch __user *ubatch) {
+    struct ddriver_batch batch;
+    struct ddriver_batch_ent *ents;
+    struct ddriver_batch_ent *ent;
+    struct iov_iter iter;
+    struct iovec iov;
+    size_t bytes;
+    long ret = 0;
+    int op;
+    int i;
+
+    if (copy_from_user(&batch, ubatch, sizeof(struct ddriver_batch)))
+        return -EFAULT;
+    if (batch.nr < 0)
+        return -EINVAL;
+    if (batch.nr > CONFIG_BATCH_MAX)
+        return -E2BIG;
+    bytes = batch.nr * sizeof(struct ddriver_batch_ent);
+    ents = kvmalloc_array(batch.nr, sizeof(struct ddriver_batch_ent), GFP_KERNEL);
+    if (!ents)
+        return -ENOMEM;
+    if (copy_from_user(ents, u64_to_user_ptr(batch.ents), bytes)) {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    batch.done = 0;
+    for (i = 0; i < batch.nr; i++) {
+        ent = &ents[i];
+        op = ent->op & ~DDRIVER_OP_FUA;
+        if ((op != DDRIVER_OP_READ && op != DDRIVER_OP_WRITE) || ent->nblocks <= 0) {
+            ent->res = -EINVAL;
+            continue;
+        }
+        iov.iov_base = u64_to_user_ptr(ent->buf);
+        iov.iov_len  = (size_t)ent->nblocks * disk.iounit_size;
+        iov_iter_init(&iter, op == DDRIVER_OP_WRITE ? WRITE : READ, &iov, 1, iov.iov_len);
+        ent->res = disk_rw(op, ent->offset, &iter);
+        if (ent->res >= 0)
+            batch.done++;
+    }
+
+    if (copy_to_user(u64_to_user_ptr(batch.ents), ents, bytes) ||
+        put_user(batch.done, &ubatch->done))
+        ret = -EFAULT;
+out:
+    kvfree(ents);
+    return ret;
+}
+/**
+ * @brief STATE_V2：快照近900字节，在堆上组装，不占ioctl的栈
+ * 
+ * @param ustat         User's ddriver_state_v2
+ * @return long         0 or -errno
+ */
+static long ioctl_state_v2(struct ddriver_state_v2 __user *ustat) {
+    struct ddriver_state_v2 *stat;
+    long ret = 0;
+
+    stat = kmalloc(sizeof(struct ddriver_state_v2), GFP_KERNEL);
+    if (!stat)
+        return -ENOMEM;
+    stat_merge(stat);
+    if (copy_to_user(ustat, stat, sizeof(struct ddriver_state_v2)))
+        ret = -EFAULT;
+    kfree(stat);
+    return ret;
+}
+/**
+ * @brief GEOMETRY，不内联，结构体只在本帧内占栈
+ */
+static noinline_for_stack long ioctl_geometry(struct ddriver_geometry __user *ugeo) {
+    struct ddriver_geometry geo;
+
+    memset(&geo, 0, sizeof(struct ddriver_geometry));
+    geo.disk_size   = disk.layout_size;
+    geo.iounit_size = disk.iounit_size;
+    geo.read_lat    = disk.read_lat;
+    geo.write_lat   = disk.write_lat;
+    geo.seek_lat    = disk.seek_lat;
+    geo.xfer_bw     = disk.xfer_bw;
+    geo.track_num   = disk.track_num;
+    geo.queue_depth = disk.profile->queue_depth;
+    memcpy(geo.profile, disk.profile->name, DDRIVER_NAME_LEN);
+    if (copy_to_user(ugeo, &geo, sizeof(struct ddriver_geometry)))
+        return -EFAULT;
+    return 0;
+}
+/**
+ * @brief SIM_TIME，不内联，理由同ioctl_geometry
+ */
+static noinline_for_stack long ioctl_sim_time(struct ddriver_sim_time __user *usim) {
+    struct ddriver_sim_time sim;
+
+    sim.service_us = STAT_READ(disk.service_us);
+    sim.clock_us   = dev_now() - disk.open_us;
+    if (copy_to_user(usim, &sim, sizeof(struct ddriver_sim_time)))
+        return -EFAULT;
+    return 0;
+}
+/**
+ * @brief 从设备ofs处读出len字节到内核缓冲区，可跨页，供块设备使用
+ */
+static void disk_read_buf(void *buf, loff_t ofs, size_t len) {
+    struct page *page;
+    size_t pofs, chunk;
+
+    while (len > 0) {
+        pofs  = offset_in_page(ofs);
+        chunk = min_t(size_t, len, PAGE_SIZE - pofs);
+        page  = disk_get_page(ofs >> PAGE_SHIFT, false);
+        if (page == NULL)
+            memset(buf, 0, chunk);
+        else {
+            memcpy(buf, page_address(page) + pofs, chunk);
+            put_page(page);
+        }
+        buf += chunk;
+        ofs += chunk;
+        len -= chunk;
+    }
+}
+/**
+ * @brief 将内核缓冲区的len字节写入设备ofs处，按需分配页，供块设备使用
+ */
+static int disk_write_buf(loff_t ofs, const void *buf, size_t len) {
+    struct page *page;
+    size_t pofs, chunk;
+
+    while (len > 0) {
+        pofs  = offset_in_page(ofs);
+        chunk = min_t(size_t, len, PAGE_SIZE - pofs);
+        page  = disk_get_page(ofs >> PAGE_SHIFT, true);
+        if (page == NULL)
+            return -ENOMEM;
+        memcpy(page_address(page) + pofs, buf, chunk);
+        put_page(page);
+        buf += chunk;
+        ofs += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+/**
+ * @brief 丢弃[ofs, ofs + len)：整页释放，不足一页的部分清零，再解除映射。
+ *        先摘页后解除映射：之后的缺页只能拿到新页；摘除前已查到旧页的缺页
+ *        持有页锁直到装好PTE，这里等它装好，随后一并解除
+ */
+static void disk_discard(loff_t ofs, loff_t len) {
+    struct page *page;
+    size_t pofs, chunk;
+    loff_t start = ofs, end = ofs + len;
+
+    while (len > 0) {
+        pofs  = offset_in_page(ofs);
+        chunk = min_t(loff_t, len, PAGE_SIZE - pofs);
+        if (chunk == PAGE_SIZE) {
+            page = xa_erase(&disk.pages, ofs >> PAGE_SHIFT);
+            if (page != NULL) {
+                lock_page(page);                      /* Wait out a fault mapping it */
+                unlock_page(page);
+                put_page(page);                       /* Freed once readers are done */
+            }
+        }
+        else {
+            page = disk_get_page(ofs >> PAGE_SHIFT, false);
+            if (page != NULL) {
+                memset(page_address(page) + pofs, 0, chunk);
+                put_page(page);
+            }
+        }
+        ofs += chunk;
+        len -= chunk;
+    }
+    unmap_mapping_range(&disk.mapping, start, end - start, 1);
+}
 /******************************************************************************
 * SECTION: Function definitions
 *******************************************************************************/
 static int      device_open(struct inode *, struct file *);
 static int      device_release(struct inode *, struct file *);
-static ssize_t  device_read(struct file *, char *, size_t, loff_t *);
-static ssize_t  device_write(struct file *, const char *, size_t, loff_t *);
+static ssize_t  device_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t  device_write_iter(struct kiocb *, struct iov_iter *);
 static loff_t   device_seek(struct file *, loff_t, int);
 static long     device_ioctl(struct file *, unsigned int, unsigned long);
+static int      device_mmap(struct file *, struct vm_area_struct *);
+static vm_fault_t device_fault(struct vm_fault *);
 /******************************************************************************
 * SECTION: Global var or structure definitions
 *******************************************************************************/
 static struct file_operations file_ops = {
-    .read = device_read,
-    .write = device_write,
+    .read_iter = device_read_iter,
+    .write_iter = device_write_iter,
     .open = device_open,
     .llseek = device_seek,
     .unlocked_ioctl = device_ioctl,
+    .mmap = device_mmap,
     .release = device_release
 };
+
+static const struct vm_operations_struct vm_ops = {
+    .fault = device_fault
+};
 /******************************************************************************
 * SECTION: Function Implementation
 *******************************************************************************/
 /**
- * @brief Disk Read
+ * @brief Disk Read, serves read/pread/readv of any number of whole blocks 
+ *        in one call, starting at the position of the file or of pread
  * 
- * @param file          Ignored
- * @param user_buffer   User space buffer
- * @param size          Must equal to Blocksize @CONFIG_BLOCK_SZ
- * @param offset        Ignored
- * @return ssize_t      Bytes have been read 
+ * @param iocb          Position in ki_pos, aligned to the IO unit
+ * @param to            User buffers, total a multiple of the IO unit
+ * @return ssize_t      Bytes have been read, 0 at the end of disk
  */
 static ssize_t 
-device_read(struct file *file, char *user_buffer, size_t size, loff_t *offset) {
-    IGNORE_ARG(offset);
-    IGNORE_ARG(file);
-    int res = check_valid(size);
-    if(res < 0)
-        return res;
-    if (copy_to_user(user_buffer, disk.head, CONFIG_BLOCK_SZ))
-        return -EFAULT;
-    FORWARD_HEAD(disk, CONFIG_BLOCK_SZ);
-    INC_READCNT(disk);
-    return CONFIG_BLOCK_SZ;
+device_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    ssize_t ret = disk_rw(DDRIVER_OP_READ, iocb->ki_pos, to);
+
+    if (ret > 0)
+        iocb->ki_pos += ret;
+    return ret;
 }
 /**
- * @brief Disk Write
+ * @brief Disk Write, serves write/pwrite/writev of any number of whole blocks 
+ *        in one call, starting at the position of the file or of pwrite
  * 
- * @param file          Ignored
- * @param user_buffer   User space buffer, copy content from
- * @param size          Must equal to Blocksize @CONFIG_BLOCK_SZ
- * @param offset        Ignored
+ * @param iocb          Position in ki_pos, aligned to the IO unit
+ * @param from          User buffers, total a multiple of the IO unit
  * @return ssize_t      Bytes have been written
  */
 static ssize_t 
-device_write(struct file *file, const char *user_buffer, size_t size, loff_t *offset) {
-    IGNORE_ARG(offset);
-    IGNORE_ARG(file);
-    int res = check_valid(size);
-    if(res < 0)
-        return res;
+device_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    ssize_t ret = disk_rw(DDRIVER_OP_WRITE, iocb->ki_pos, from);
 
-    if (copy_from_user(disk.head, user_buffer, CONFIG_BLOCK_SZ))
-        return -EFAULT;
-    FORWARD_HEAD(disk, CONFIG_BLOCK_SZ);
-    INC_WRITECNT(disk);
-    return CONFIG_BLOCK_SZ;
+    if (ret > 0)
+        iocb->ki_pos += ret;
+    return ret;
 }
 /**
- * @brief Disk Seek
+ * @brief Disk Seek, moves the position of this file only. The shared head
+ *        moves, and the seek is counted and paid, when I/O starts there; 
+ *        ddriver_seek of the user driver follows the same rule
  * 
- * @param file          Ignored
- * @param offset        Aligned to @CONFIG_BLOCK_SZ
- * @param whence        SEEK_CUR, SEEK_SET
+ * @param file          Its f_pos is the position
+ * @param offset        Aligned to the IO unit (block_size)
+ * @param whence        SEEK_SET, SEEK_CUR, SEEK_END
  * @return loff_t       cur pos
  */
 static loff_t 
 device_seek(struct file *file, loff_t offset, int whence) {
-    IGNORE_ARG(file);
+    loff_t pos;
+
     if (!IS_ADDR_ALIGN(offset)) {
         kernel_alert("offset %lld must be aligned to block size %d", 
-                      offset, CONFIG_BLOCK_SZ);
+                      offset, disk.iounit_size);
         return -EINVAL;
     }
     switch (whence)
     {
     case SEEK_SET:
-        SET_HEAD(disk, offset);
+        pos = offset;
         break;
     case SEEK_CUR:
-        FORWARD_HEAD(disk, offset);
+        pos = file->f_pos + offset;
         break;
-    default:
+    case SEEK_END:
+        pos = disk.layout_size + offset;
         break;
+    default:
+        return -EINVAL;
     }
-    INC_SEEKCNT(disk);
-    return GET_HEAD_POS(disk);
+    if (pos < 0 || pos > disk.layout_size)
+        return -EINVAL;
+    file->f_pos = pos;
+    return pos;
 }
 /**
  * @brief Disk ioctl
  * 
- * @param file          Ignored
+ * @param file          Its position is rewound by RESET
  * @param cmd           Command
  * @param arg           Args
  * @return long         State
  */
 static long 
 device_ioctl(struct file *file, unsigned int cmd, unsigned long arg){
-    IGNORE_ARG(file);
     int ret;
+    int size;
+    long long size64;
     struct ddriver_state state;
+    struct ddriver_discard discard;
     switch (cmd)
     {
-    case IOC_REQ_DEVICE_SIZE:                         /* Device Size */
-        ret = copy_to_user((int __user *)arg, &disk.layout_size, sizeof(int));
+    case IOC_REQ_DEVICE_SIZE:                         /* Device Size, clamped to int */
+        size = disk.layout_size > INT_MAX ? ADDR_ROUND_UP(INT_MAX) : disk.layout_size;
+        ret = copy_to_user((int __user *)arg, &size, sizeof(int));
+        if (ret) 
+            return -EFAULT;
+        break;
+    case IOC_REQ_DEVICE_SIZE64:                       /* Device Size, 64 bits */
+        size64 = disk.layout_size;
+        ret = copy_to_user((long long __user *)arg, &size64, sizeof(long long));
         if (ret) 
             return -EFAULT;
         break;
+    case IOC_REQ_DEVICE_GEOMETRY:                     /* Device Geometry */
+        return ioctl_geometry((struct ddriver_geometry __user *)arg);
+    case IOC_REQ_DEVICE_SIM_TIME:                     /* Emulated Device Time */
+        return ioctl_sim_time((struct ddriver_sim_time __user *)arg);
     case IOC_REQ_DEVICE_STATE:                        /* Device State */
-        state.read_cnt = disk.read_cnt;
-        state.write_cnt = disk.write_cnt;
-        state.seek_cnt = disk.seek_cnt;
+        state.read_cnt = STAT_READ(disk.read.blks);   /* Truncated, see V2 */
+        state.write_cnt = STAT_READ(disk.write.blks);
+        state.seek_cnt = STAT_READ(disk.seek_cnt);
         ret = copy_to_user((int __user *)arg, &state, sizeof(struct ddriver_state));
         if (ret) 
             return -EFAULT;
         break;
+    case IOC_REQ_DEVICE_STATE_V2:                     /* Extended Device State */
+        return ioctl_state_v2((struct ddriver_state_v2 __user *)arg);
+    case IOC_REQ_DEVICE_STATE_RESET:                  /* New statistics epoch */
+        new_epoch();
+        break;
     case IOC_REQ_DEVICE_RESET:                        /* Reset Device */
-        disk.head = disk.layout;
-        disk.read_cnt = 0;
-        disk.write_cnt = 0;
-        disk.seek_cnt = 0;
+        RESET_HEAD(disk);
+        file->f_pos = 0;
+        new_epoch();
+        atomic64_set(&disk.service_us, 0);
+        break;
+    case IOC_REQ_DEVICE_DISCARD:                      /* Discard a block range */
+        ret = copy_from_user(&discard, (struct ddriver_discard __user *)arg, 
+                             sizeof(struct ddriver_discard));
+        if (ret) 
+            return -EFAULT;
+        if (!IS_ADDR_ALIGN(discard.offset) || !IS_ADDR_ALIGN(discard.len) ||
+            discard.offset < 0 || discard.len < 0 || 
+            discard.offset + discard.len > disk.layout_size)
+            return -EINVAL;
+        disk_discard(discard.offset, discard.len);    /* Mappings refault the fresh pages */
         break;
+    case IOC_REQ_DEVICE_BATCH:                        /* Several reads/writes in one entry */
+        return disk_batch((struct ddriver_batch __user *)arg);
     case IOC_REQ_DEVICE_IO_SZ:
         ret = copy_to_user((int __user *)arg, &disk.iounit_size, sizeof(int));
         if (ret) 
@@ -234,22 +918,69 @@ device_ioctl(struct file *file, unsigned int cmd, unsigned long arg){
     return 0;
 }
 /**
- * @brief Disk Open
+ * @brief Disk mmap, maps the device pages themselves, so loads and stores
+ *        through the mapping need no copy and no syscall
  * 
- * @param inode         Ignored
  * @param file          Ignored
+ * @param vma           Must lie within the disk
+ * @return int          state
+ */
+static int 
+device_mmap(struct file *file, struct vm_area_struct *vma) {
+    unsigned long len = vma->vm_end - vma->vm_start;
+    IGNORE_ARG(file);
+
+    if (vma->vm_pgoff > (disk.layout_size >> PAGE_SHIFT) ||
+        len > disk.layout_size - ((loff_t)vma->vm_pgoff << PAGE_SHIFT))
+        return -EINVAL;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#else
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#endif
+    vma->vm_ops = &vm_ops;                            /* Pages are faulted in on access */
+    return 0;
+}
+/**
+ * @brief Page fault of a mapping, allocates the page if it was never written
+ * 
+ * @param vmf           Fault
+ * @return vm_fault_t   state
+ */
+static vm_fault_t 
+device_fault(struct vm_fault *vmf) {
+    struct page *page;
+
+    if (vmf->pgoff >= DIV_ROUND_UP(disk.layout_size, PAGE_SIZE))
+        return VM_FAULT_SIGBUS;
+    page = disk_get_page(vmf->pgoff, true);
+    if (page == NULL)
+        return VM_FAULT_OOM;
+    lock_page(page);                                  /* Held until the PTE is set, see disk_discard */
+    if (xa_load(&disk.pages, vmf->pgoff) != page) {
+        unlock_page(page);                            /* Discarded meanwhile, fault again */
+        put_page(page);
+        return VM_FAULT_NOPAGE;
+    }
+    vmf->page = page;                                 /* Our reference, dropped when unmapped */
+    return VM_FAULT_LOCKED;
+}
+/**
+ * @brief Disk Open. Any number of openers may share the device, e.g. a
+ *        monitor beside a live mount, each with its own position in f_pos.
+ *        All of them map through disk.mapping, so DISCARD reaches every mapping
+ * 
+ * @param inode         Ignored
+ * @param file          Its f_mapping is replaced
  * @return int          state
  */
 static int 
 device_open(struct inode *inode, struct file *file) {
     IGNORE_ARG(inode);
-    IGNORE_ARG(file);
     
-    if (disk.open_count) {                            /* If device is open, return busy */
-        return -EBUSY;
-    }
-    RESET_HEAD(disk);                                 /* Everytime close device, reset head */
-    disk.open_count++;
+    file->f_mapping = &disk.mapping;
+    if (atomic_inc_return(&disk.open_count) == 1)     /* First opener, reset head */
+        RESET_HEAD(disk);
     try_module_get(THIS_MODULE);
     return 0;
 }
@@ -266,26 +997,220 @@ device_release(struct inode *inode, struct file *file) {
                                                          Without this, the module would not unload. */
     IGNORE_ARG(inode);
     IGNORE_ARG(file);
-    disk.open_count--;
+    atomic_dec(&disk.open_count);
     module_put(THIS_MODULE);
     return 0;
 }
 /******************************************************************************
+* SECTION: Block Device
+*******************************************************************************/
+#if HAS_BLK_MQ_DISK
+/**
+ * @brief blk-mq request, served synchronously from the same pages, 
+ *        with the same latency model and statistics as the character device
+ * 
+ * @param hctx          Ignored, single hardware queue
+ * @param bd            Request
+ * @return blk_status_t state
+ */
+static blk_status_t 
+blk_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd) {
+    struct request *rq = bd->rq;
+    struct req_iterator iter;
+    struct bio_vec bvec;
+    loff_t pos = (loff_t)blk_rq_pos(rq) << SECTOR_SHIFT;
+    blk_status_t status = BLK_STS_OK;
+    void *buf;
+    IGNORE_ARG(hctx);
+
+    blk_mq_start_request(rq);
+    switch (req_op(rq))
+    {
+    case REQ_OP_READ:
+    case REQ_OP_WRITE:
+        emulate_delay(model_io(req_op(rq) == REQ_OP_READ ? DDRIVER_OP_READ : DDRIVER_OP_WRITE, 
+                               pos, blk_rq_bytes(rq)));
+        rq_for_each_segment(bvec, rq, iter) {          /* Single-page segments */
+            if (status != BLK_STS_OK)
+                continue;
+            buf = kmap_local_page(bvec.bv_page) + bvec.bv_offset;
+            if (req_op(rq) == REQ_OP_READ)
+                disk_read_buf(buf, pos, bvec.bv_len);
+            else if (disk_write_buf(pos, buf, bvec.bv_len) < 0)
+                status = BLK_STS_RESOURCE;
+            kunmap_local(buf);
+            pos += bvec.bv_len;
+        }
+        break;
+    case REQ_OP_DISCARD:
+    case REQ_OP_WRITE_ZEROES:
+        disk_discard(pos, blk_rq_bytes(rq));
+        break;
+    case REQ_OP_FLUSH:                                /* No volatile cache */
+        break;
+    default:
+        status = BLK_STS_NOTSUPP;
+        break;
+    }
+    blk_mq_end_request(rq, status);
+    return BLK_STS_OK;
+}
+
+static const struct blk_mq_ops blk_mq_ops = {
+    .queue_rq = blk_queue_rq
+};
+
+static const struct block_device_operations blk_ops = {
+    .owner = THIS_MODULE
+};
+
+static void blk_put_disk(struct gendisk *gd) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+    put_disk(gd);
+#else
+    blk_cleanup_disk(gd);
+#endif
+}
+/**
+ * @brief 注册blk-mq块设备/dev/ddriverb，与字符设备共享存储与统计，
+ *        可在其上创建内核文件系统，与newfs在同样的模拟介质上比较
+ * 
+ * @return int          0 or -errno
+ */
+static int ddriver_blk_init(void) {
+    struct gendisk *gd;
+    int ret;
+
+    if (disk.iounit_size > PAGE_SIZE) {
+        kernel_alert("block device needs block_size <= %ld", PAGE_SIZE);
+        return -EINVAL;
+    }
+    ret = register_blkdev(0, DEVICE_NAME);
+    if (ret < 0)
+        return ret;
+    disk.blk_major = ret;
+
+    disk.tag_set.ops          = &blk_mq_ops;
+    disk.tag_set.nr_hw_queues = 1;
+    disk.tag_set.queue_depth  = CONFIG_BLK_QUEUE_DEPTH;
+    disk.tag_set.numa_node    = NUMA_NO_NODE;
+    disk.tag_set.flags        = BLK_MQ_F_BLOCKING;   /* queue_rq may allocate and sleep */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 14, 0)
+    disk.tag_set.flags       |= BLK_MQ_F_SHOULD_MERGE;
+#endif
+    ret = blk_mq_alloc_tag_set(&disk.tag_set);
+    if (ret)
+        goto out_blkdev;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+    {
+        struct queue_limits lim = {
+            .logical_block_size     = disk.iounit_size,
+            .physical_block_size    = disk.iounit_size,
+            .max_hw_discard_sectors = UINT_MAX
+        };
+        gd = blk_mq_alloc_disk(&disk.tag_set, &lim, NULL);
+    }
+#else
+    gd = blk_mq_alloc_disk(&disk.tag_set, NULL);
+#endif
+    if (IS_ERR(gd)) {
+        ret = PTR_ERR(gd);
+        goto out_tag_set;
+    }
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 9, 0)
+    blk_queue_logical_block_size(gd->queue, disk.iounit_size);
+    blk_queue_physical_block_size(gd->queue, disk.iounit_size);
+    blk_queue_max_discard_sectors(gd->queue, UINT_MAX);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 19, 0)
+    blk_queue_flag_set(QUEUE_FLAG_DISCARD, gd->queue);
+#endif
+#endif
+    gd->major        = disk.blk_major;
+    gd->first_minor  = 0;
+    gd->minors       = 1;
+    gd->fops         = &blk_ops;
+    gd->private_data = &disk;
+    snprintf(gd->disk_name, DISK_NAME_LEN, DEVICE_NAME "b");
+    set_capacity(gd, disk.layout_size >> SECTOR_SHIFT);
+    ret = add_disk(gd);
+    if (ret)
+        goto out_disk;
+    disk.gd = gd;
+    return 0;
+
+out_disk:
+    blk_put_disk(gd);
+out_tag_set:
+    blk_mq_free_tag_set(&disk.tag_set);
+out_blkdev:
+    unregister_blkdev(disk.blk_major, DEVICE_NAME);
+    disk.blk_major = 0;
+    return ret;
+}
+
+static void ddriver_blk_exit(void) {
+    if (disk.gd == NULL)
+        return;
+    del_gendisk(disk.gd);
+    blk_put_disk(disk.gd);
+    blk_mq_free_tag_set(&disk.tag_set);
+    unregister_blkdev(disk.blk_major, DEVICE_NAME);
+    disk.gd = NULL;
+}
+#else
+static int ddriver_blk_init(void) {
+    kernel_alert("block device mode needs kernel 5.15 or later");
+    return -EOPNOTSUPP;
+}
+
+static void ddriver_blk_exit(void) {
+}
+#endif
+/******************************************************************************
 * SECTION: Module Register and Unregister
 *******************************************************************************/
 static int __init 
 ddriver_init(void)
 {
-    int major_num = register_chrdev(0, DEVICE_NAME, &file_ops);   
+    int major_num;
+    int ret;
+
+    disk.layout_size = memparse(disk_size, NULL);
+    disk.iounit_size = block_size;
+    if (block_size < CONFIG_BLOCK_SZ || (block_size & (block_size - 1)) != 0) {
+        kernel_alert("block_size %d should be a power of 2 and at least %d", 
+                     block_size, CONFIG_BLOCK_SZ);
+        return -EINVAL;
+    }
+    if (disk.layout_size <= 0 || !IS_ADDR_ALIGN(disk.layout_size)) {
+        kernel_alert("disk_size %s should align to block_size %d", disk_size, block_size);
+        return -EINVAL;
+    }
+    ret = load_geometry();
+    if (ret < 0)
+        return ret;
+    disk.open_us = dev_now();
+    address_space_init_once(&disk.mapping);
+    kernel_info("disk size %lld, block size %d, profile %s", 
+                disk.layout_size, disk.iounit_size, disk.profile->name);
+
+    major_num = register_chrdev(0, DEVICE_NAME, &file_ops);   
                                                       /* Register an device */
     if (major_num < 0) {                              /* Register fail */
         kernel_alert("Can't register device, ret %d", major_num);
         return major_num;
     } 
     else {                                            /* Register success */                                                  
+        disk.major_num = major_num;                   /* Pages start absent, i.e. zero */
+        if (blkdev && (ret = ddriver_blk_init()) < 0) {
+            kernel_alert("Can't register block device, ret %d", ret);
+            unregister_chrdev(major_num, DEVICE_NAME);
+            return ret;
+        }
+        disk.debugfs = debugfs_create_dir(DEVICE_NAME, NULL);
+        debugfs_create_file("stats", 0444, disk.debugfs, NULL, &stats_fops);
         kernel_info("module loaded with device major number %d", major_num);
-        disk.major_num = major_num;
-        memset(disk.layout, 0, CONFIG_DISK_SZ);
         return 0;
     }
     return 0;
@@ -295,10 +1220,18 @@ static void __exit
 ddriver_exit(void)
 {   
     int major_num = disk.major_num;
+    struct page *page;
+    unsigned long idx;
+
     kernel_info("Goodbye %d", major_num);
+    debugfs_remove_recursive(disk.debugfs);
+    ddriver_blk_exit();
     if(major_num != 0){
         unregister_chrdev(major_num, DEVICE_NAME);
     }
+    xa_for_each(&disk.pages, idx, page)
+        put_page(page);
+    xa_destroy(&disk.pages);
 }
 
 module_init(ddriver_init);
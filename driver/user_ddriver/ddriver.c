@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "stdio.h"
 #include "stdlib.h"
 #include <unistd.h>
@@ -8,11 +9,23 @@
 #include "ddriver_ctl.h"
 #include "stdio.h"
 #include "errno.h"
-#include <pwd.h>
 #include <time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <assert.h>
 
 extern int errno;
 
+struct ddriver;
+void log_push(struct ddriver *disk, int level, const char *fmt, ...) 
+    __attribute__((format(printf, 3, 4)));
+
 #define USER_INFO     "INFO: "
 #define USER_ALERT    "WARNING: "
 
@@ -21,157 +34,1947 @@ extern int errno;
 * SECTION: Macro definitions
 *******************************************************************************/   
 #define DEVICE_NAME   "ddriver"
-#define DEVICE_LOG    "ddriver_log"
+#define DEVICE_LOG    "_log"                          /* Log path: image path + suffix */
 
-#define user_info(fmt, ...)\
+#define user_log(disk, lvl, fmt, ...)\
 	do {\
-		printf(USER_INFO DEVICE_NAME " " fmt "\n", ##__VA_ARGS__);\
-        fprintf(debugf, USER_PANIC  " " fmt "\n", ##__VA_ARGS__);\
+		if ((lvl) >= (disk)->log.level)\
+			log_push(disk, lvl, fmt, ##__VA_ARGS__);\
 	} while(0)\
 
-#define user_alert(fmt, ...)\
-	do {\
-		printf(USER_ALERT DEVICE_NAME " " fmt "\n", ##__VA_ARGS__);\
-        fprintf(debugf, USER_PANIC  " " fmt "\n", ##__VA_ARGS__);\
-	} while(0)\
+#define user_debug(disk, fmt, ...) user_log(disk, DDRIVER_LOG_DEBUG, fmt, ##__VA_ARGS__)
+#define user_info(disk, fmt, ...)  user_log(disk, DDRIVER_LOG_INFO, fmt, ##__VA_ARGS__)
+#define user_alert(disk, fmt, ...) user_log(disk, DDRIVER_LOG_WARN, fmt, ##__VA_ARGS__)
 
-#define user_panic(fmt, ...)\
+/* Echoed by the drainer once the log runs, printed here before and after */
+#define user_panic(disk, fmt, ...)\
     do {\
-        printf(USER_PANIC  " " fmt "\n", ##__VA_ARGS__);\
+        if (!__atomic_load_n(&(disk)->log.ready, __ATOMIC_ACQUIRE))\
+            printf(USER_PANIC DEVICE_NAME " " fmt "\n", ##__VA_ARGS__);\
+        user_log(disk, DDRIVER_LOG_PANIC, fmt, ##__VA_ARGS__);\
     } while (0)\
 
-#define DRIVER_AUTHOR   "Deadpool <deadpoolmine@qq.com>"
-#define DRIVER_DESC     "A Fake disk driver in user space"
-#define DRIVER_VERSION  "0.1.0"
+#define DRIVER_AUTHOR   "Deadpool <deadpoolmine@qq.com>"
+#define DRIVER_DESC     "A Fake disk driver in user space"
+#define DRIVER_VERSION  "0.1.0"
+
+#define CONFIG_DISK_SZ  (4 * 1024 * 1024)
+#define CONFIG_BLOCK_SZ (512)
+#define CONFIG_QUEUE_DEPTH (64)                      /* Max in-flight async requests */
+#define CONFIG_SEEK_POINTS (8)                       /* Max points of a seek curve */
+#define CONFIG_PROFILE     "hdd"                     /* Default device profile */
+#define CONFIG_LOG_ENTRIES (1024)                    /* Log ring slots, power of 2 */
+#define CONFIG_LOG_MSG_LEN (120)                     /* Longer messages are truncated */
+#define CONFIG_LOG_DRAIN_US (10000)                  /* Drain period of the log thread */
+#define CONFIG_MAX_FDS     (1024)                    /* Instances are looked up by fd */
+#define CONFIG_STAT_SHARDS (16)                      /* Counter shards, merged on read */
+#define CONFIG_DIO_ALIGN   (4096)                    /* O_DIRECT buffer alignment */
+#define CONFIG_BOUNCE_BUFS (16)                      /* Bounce pool size, at most 64 */
+#define CONFIG_BOUNCE_SZ   (64 * 1024)               /* Larger requests are chunked */
+#define CONFIG_PLUG_DEPTH  (32)                      /* Queued requests that force a dispatch */
+#define CONFIG_SCHED_EXPIRE_US (500000)              /* Deadline of a queued request */
+#define CONFIG_BACKEND     "file"                    /* Default backend for image files */
+/******************************************************************************
+* SECTION: Macro Functions 
+*******************************************************************************/
+#define IGNORE_ARG(arg)         ((void)arg)
+#define IS_DIO_ALIGN(ptr)       ((uintptr_t)(ptr) % CONFIG_DIO_ALIGN == 0)
+#define MIN(a, b)               ((a) < (b) ? (a) : (b))
+#define MAX(a, b)               ((a) > (b) ? (a) : (b))
+#define IS_ADDR_ALIGN(disk, addr) ((addr) % (disk)->iounit_size == 0)
+#define REQ_END(disk, req)      ((req)->offset + (off_t)(req)->nblocks * (disk)->iounit_size)
+#define ADDR_ROUND_UP(disk, addr) (((addr) / (disk)->iounit_size) * (disk)->iounit_size)
+
+#define OP_CODE(op)             ((op) & ~DDRIVER_OP_FUA)
+#define IS_WRITE(op)            (OP_CODE(op) == DDRIVER_OP_WRITE)
+#define OP_STAT(st, op)         (IS_WRITE(op) ? &(st)->write : &(st)->read)
+#define STAT_SHARD(disk)        (&(disk)->stat[stat_shard()].st)
+#define STAT_ADD(var, val)      (__atomic_fetch_add(&(var), val, __ATOMIC_RELAXED))
+
+#define MOVE_HEAD(disk, ofs)    (__atomic_exchange_n(&(disk)->head, ofs, __ATOMIC_RELAXED))
+#define WCACHE_HIT(disk, op)    ((disk)->wcache_blks > 0 && (op) == DDRIVER_OP_WRITE)
+#define SEEK_HEAD(disk, op, end) (WCACHE_HIT(disk, op) ? \
+                                  __atomic_load_n(&(disk)->head, __ATOMIC_RELAXED) : MOVE_HEAD(disk, end))
+#define WCACHE_TEST(disk, blk)  ((disk)->wcache_map[(blk) / 64] & (1ULL << ((blk) % 64)))
+
+#define XFER_DELAY(disk, bytes) ((bytes) / (disk)->xfer_bw)
+#define RW_LAT_US(disk, op, bytes)                                          \
+        ((IS_WRITE(op) ? (disk)->write_lat : (disk)->read_lat) +            \
+         XFER_DELAY(disk, bytes))
+/******************************************************************************
+* SECTION: Type definitions
+*******************************************************************************/
+struct ddriver_inflight
+{
+    uint64_t tag;                                    /* User tag */
+    int      res;                                    /* Bytes transferred or -errno */
+    uint64_t deadline;                               /* Emulated completion time, us */
+    uint64_t id;                                     /* user_data of its SQE */
+    int      pending;                                /* Data still moving in io_uring */
+};
+
+struct ddriver_uring
+{
+    int      fd;                                     /* -1: data moves at submit */
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void     *sq_ring, *cq_ring;
+    size_t   sq_len, cq_len, sqes_len;
+    uint64_t next_id;
+    pthread_mutex_t wait;                            /* Held to consume CQEs or wait for them */
+};
+
+struct ddriver_pending
+{
+    struct ddriver_req req;                          /* Queued, not yet served */
+    uint64_t arrive;                                 /* Device clock at submit, us */
+};
+
+struct ddriver_seek_point
+{
+    int permille;                                    /* Seek distance, per mille of full stroke */
+    int lat;                                         /* Seek latency at that distance, us */
+};
+
+struct ddriver_profile
+{
+    char name[DDRIVER_NAME_LEN];
+    int  read_lat;                                   /* Per request overhead, us */
+    int  write_lat;
+    int  seek_lat;                                   /* Rotation, us per 360 degree */
+    int  xfer_bw;                                    /* MB/s */
+    int  queue_depth;                                /* Requests served in parallel */
+    int  seek_points;                                /* 0: no arm movement cost */
+    struct ddriver_seek_point seek_curve[CONFIG_SEEK_POINTS];
+};
+
+struct ddriver_log_slot
+{
+    uint64_t seq;                                    /* Ring position this slot is ready for */
+    uint64_t ts_us;
+    int      level;
+    int      len;
+    char     msg[CONFIG_LOG_MSG_LEN];
+};
+
+struct ddriver_log
+{
+    struct ddriver_log_slot ring[CONFIG_LOG_ENTRIES];
+    uint64_t head;                                   /* Next slot to drain, drainer only */
+    uint64_t tail;                                   /* Next slot to fill, producers CAS it */
+    uint64_t dropped;                                /* Records lost to a full ring */
+    uint64_t reported;                               /* Drops already written to the log */
+    uint64_t written;                                /* Records written to the log */
+    int      level;                                  /* Records below it are not queued */
+    int      binary;                                 /* Write struct ddriver_log_rec records */
+    int      ready;                                  /* Ring initialized and accepting */
+    int      running;                                /* Drain thread alive */
+    pthread_t       drainer;
+    pthread_mutex_t lock;                            /* Serializes drainers, not producers */
+    pthread_cond_t  kick;
+    FILE     *out;                                   /* Log file */
+};
+
+struct ddriver_backend
+{
+    const char *name;
+    int     (*open)(struct ddriver *disk, const char *path);  /* Returns the fd or -errno */
+    ssize_t (*rw)(struct ddriver *disk, int op, const struct iovec *iov, int iovcnt, 
+                  size_t total, off_t ofs);
+    int     (*discard)(struct ddriver *disk, off_t offset, off_t len);
+    int     (*drop_cache)(struct ddriver *disk);             /* NULL: nothing cached */
+    int     (*ioctl)(struct ddriver *disk, unsigned long cmd, void *arg); 
+                                                     /* NULL or -ENOTTY: served here */
+    int     native_lat;                              /* Device emulates latency itself */
+};
+
+struct ddriver_stat_shard
+{
+    struct ddriver_state_v2 st;                      /* epoch fields unused here */
+} __attribute__((aligned(64)));
+
+struct ddriver
+{
+    int  ddriver_fd;                                 /* Disk ddriver_fd */
+    const struct ddriver_backend *backend;           /* Storage engine under the model */
+    off_t head;                                      /* Emulated disk head, moved by I/O only */
+    off_t pos;                                       /* Position of ddriver_seek/read/write */
+    char *map;                                       /* Mapped image, NULL if not mapped */
+    struct ddriver_stat_shard stat[CONFIG_STAT_SHARDS]; /* Statistics of current epoch */
+    uint64_t epoch;
+    uint64_t epoch_us;
+    int  read_lat;
+    int  write_lat;
+    int  seek_lat;
+    int  xfer_bw;
+    int  track_num;
+    int  major_num;
+    off_t layout_size;
+    int  iounit_size;
+    int  vclock;                                     /* Advance virtual clock instead of sleeping */
+    int  direct;                                     /* Image opened with O_DIRECT */
+    char *bounce[CONFIG_BOUNCE_BUFS];                /* Aligned buffers for O_DIRECT */
+    uint64_t bounce_free;                            /* Bitmap of free bounce buffers */
+    uint64_t vclock_us;                              /* Virtual clock, us */
+    uint64_t service_us;                             /* Accumulated emulated service time, us */
+    uint64_t open_us;                                /* Device clock at open, us */
+    struct ddriver_profile profile;                  /* Seek curve and queue model */
+    pthread_mutex_t qlock;                           /* Protects the async queue below */
+    uint64_t busy_until[CONFIG_QUEUE_DEPTH];         /* Each channel busy until, us */
+    int  inflight_cnt;
+    int  reserved;                                   /* Slots held by submitters doing I/O */
+    struct ddriver_inflight inflight[CONFIG_QUEUE_DEPTH];
+    struct ddriver_uring uring;                      /* Async engine, SQ protected by qlock */
+    int  sched;                                      /* DDRIVER_SCHED_*, NOOP serves on submit */
+    int  pending_cnt;
+    struct ddriver_pending pending[CONFIG_QUEUE_DEPTH]; /* Request queue, in arrival order */
+    struct ddriver_sched_stat sched_stat;
+    pthread_mutex_t wlock;                           /* Protects the write cache below */
+    long long wcache_blks;                           /* Write cache size, 0: write through */
+    long long wcache_dirty;                          /* Dirty blocks in the cache */
+    uint64_t *wcache_map;                            /* Dirty bitmap, one bit per block */
+    struct ddriver_cache_stat cache_stat;            /* size and dirty filled on query */
+    pthread_mutex_t tlock;                           /* Serializes trace records */
+    FILE *trace;                                     /* Block I/O trace, NULL if off */
+    struct ddriver_log log;                          /* Per instance log, <image>_log */
+};
+/******************************************************************************
+* SECTION: Global Variable
+*******************************************************************************/
+/* Open instances, indexed by the fd ddriver_open returned */
+static struct ddriver *disks[CONFIG_MAX_FDS];
+
+/* Caller tag stamped on trace records, see IOC_REQ_DEVICE_TRACE_TAG */
+static __thread uint64_t trace_tag;
+
+/* 
+ * Built-in profiles. "hdd" is the original model: rotation cost only.
+ * reference: https://en.wikipedia.org/wiki/Hard_disk_drive_performance_characteristics
+ */
+static const struct ddriver_profile profiles[] = {
+    {
+        .name = "hdd",       .read_lat = 2000, .write_lat = 1000, .seek_lat = 4170,
+        .xfer_bw = 100,      .queue_depth = 1, .seek_points = 0
+    },
+    {
+        .name = "hdd7200",   .read_lat = 100,  .write_lat = 100,  .seek_lat = 8330,
+        .xfer_bw = 150,      .queue_depth = 1, .seek_points = 4,
+        .seek_curve = { {0, 800}, {100, 4000}, {333, 8500}, {1000, 15000} }
+    },
+    {
+        .name = "sata-ssd",  .read_lat = 90,   .write_lat = 60,   .seek_lat = 0,
+        .xfer_bw = 500,      .queue_depth = 32, .seek_points = 0
+    },
+    {
+        .name = "nvme",      .read_lat = 20,   .write_lat = 15,   .seek_lat = 0,
+        .xfer_bw = 3000,     .queue_depth = 64, .seek_points = 0
+    },
+    {
+        .name = "ram",       .read_lat = 0,    .write_lat = 0,    .seek_lat = 0,
+        .xfer_bw = 10000,    .queue_depth = 64, .seek_points = 0
+    }
+};
+
+static const char *log_prefix[] = {"DEBUG: ", USER_INFO, USER_ALERT, USER_PANIC};
+/******************************************************************************
+* SECTION: Helper Functions
+*******************************************************************************/
+struct ddriver *get_disk(int fd) {
+    if (fd < 0 || fd >= CONFIG_MAX_FDS)
+        return NULL;
+    return __atomic_load_n(&disks[fd], __ATOMIC_ACQUIRE);
+}
+
+struct ddriver *disk_alloc() {
+    struct ddriver *disk = calloc(1, sizeof(struct ddriver));
+    if (disk == NULL)
+        return NULL;
+    disk->ddriver_fd = -1;
+    disk->map        = NULL;
+    disk->uring.fd   = -1;
+    disk->log.level  = DDRIVER_LOG_INFO;
+    pthread_mutex_init(&disk->qlock, NULL);
+    pthread_mutex_init(&disk->wlock, NULL);
+    pthread_mutex_init(&disk->tlock, NULL);
+    pthread_mutex_init(&disk->uring.wait, NULL);
+    return disk;
+}
+
+int check_valid(struct ddriver *disk, size_t size) {
+    if (size != disk->iounit_size){
+        user_alert(disk, "io size %ld should align to %d", size, disk->iounit_size);
+        return -EIO;
+    }
+    return 0;
+}
+
+int check_valid_vec(struct ddriver *disk, const struct iovec *iov, int iovcnt, size_t *total) {
+    int i;
+    
+    if (iovcnt <= 0 || iovcnt > UIO_MAXIOV) {
+        user_alert(disk, "iovcnt %d out of range", iovcnt);
+        return -EINVAL;
+    }
+
+    *total = 0;
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len == 0 || !IS_ADDR_ALIGN(disk, iov[i].iov_len)) {
+            user_alert(disk, "iov[%d] size %ld should align to %d", 
+                       i, iov[i].iov_len, disk->iounit_size);
+            return -EIO;
+        }
+        *total += iov[i].iov_len;
+    }
+    return 0;
+}
+
+int check_valid_range(struct ddriver *disk, off_t offset, int nblocks) {
+    if (!IS_ADDR_ALIGN(disk, offset)) {
+        user_alert(disk, "offset %ld must be aligned to block size %d", 
+                   offset, disk->iounit_size);
+        return -EINVAL;
+    }
+    if (nblocks <= 0 || 
+        offset + (off_t)nblocks * disk->iounit_size > disk->layout_size) {
+        user_alert(disk, "range [%ld, +%d blocks) out of disk", offset, nblocks);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * @brief 原子地占用当前位置处的size字节并前移位置。越界时返回-EINVAL且位置不动
+ */
+int claim_pos(struct ddriver *disk, size_t size, off_t *ofs) {
+    off_t cur = __atomic_load_n(&disk->pos, __ATOMIC_RELAXED);
+    int ret;
+
+    do {
+        ret = check_valid_range(disk, cur, size / disk->iounit_size);
+        if (ret < 0)
+            return ret;
+    } while (!__atomic_compare_exchange_n(&disk->pos, &cur, cur + size, 1, 
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    *ofs = cur;
+    return 0;
+}
+
+long long env_size(const char *name, long long def) {
+    char *val = getenv(name);
+    char *end;
+    long long ret;
+
+    if (val == NULL || *val == '\0')
+        return def;
+    ret = strtoll(val, &end, 0);
+    switch (*end)
+    {
+    case 'G': case 'g': ret <<= 10;                  /* Fall through */
+    case 'M': case 'm': ret <<= 10;                  /* Fall through */
+    case 'K': case 'k': ret <<= 10;
+    default:
+        break;
+    }
+    return ret;
+}
+
+/**
+ * @brief 读取int型的环境变量，支持和env_size相同的K/M/G后缀；超出int范围时返回-ERANGE
+ */
+int env_int(struct ddriver *disk, const char *name, int def, int *out) {
+    long long val = env_size(name, def);
+
+    if (val < INT_MIN || val > INT_MAX) {
+        user_panic(disk, "%s=%s out of range", name, getenv(name));
+        return -ERANGE;
+    }
+    *out = (int)val;
+    return 0;
+}
+
+/**
+ * Profile file, one "key value" per line, '#' starts a comment:
+ * 
+ *     name        my-disk
+ *     read_lat    100
+ *     write_lat   100
+ *     seek_lat    8330
+ *     xfer_bw     150
+ *     queue_depth 1
+ *     seek        0    800     # permille of full stroke, us
+ *     seek        1000 15000
+ */
+int load_profile_file(struct ddriver *disk, const char *path, struct ddriver_profile *profile) {
+    char line[128], key[32];
+    int  val, val2, n;
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL) {
+        user_panic(disk, "can't open profile: %s", path);
+        return -ENOENT;
+    }
+    memset(profile, 0, sizeof(struct ddriver_profile));
+    profile->xfer_bw = 1;
+    profile->queue_depth = 1;
+    strncpy(profile->name, path, DDRIVER_NAME_LEN - 1);
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strchr(line, '#'))
+            *strchr(line, '#') = '\0';
+        n = sscanf(line, "%31s %d %d", key, &val, &val2);
+        if (n >= 1 && strcmp(key, "name") == 0)
+            sscanf(line, "%*s %31s", profile->name);
+        else if (n >= 2 && strcmp(key, "read_lat") == 0)
+            profile->read_lat = val;
+        else if (n >= 2 && strcmp(key, "write_lat") == 0)
+            profile->write_lat = val;
+        else if (n >= 2 && strcmp(key, "seek_lat") == 0)
+            profile->seek_lat = val;
+        else if (n >= 2 && strcmp(key, "xfer_bw") == 0)
+            profile->xfer_bw = val;
+        else if (n >= 2 && strcmp(key, "queue_depth") == 0)
+            profile->queue_depth = val;
+        else if (n == 3 && strcmp(key, "seek") == 0 && 
+                 profile->seek_points < CONFIG_SEEK_POINTS) {
+            profile->seek_curve[profile->seek_points].permille = val;
+            profile->seek_curve[profile->seek_points].lat = val2;
+            profile->seek_points++;
+        }
+        else if (n >= 1) {
+            user_panic(disk, "profile %s: unknown line: %s", path, line);
+            fclose(fp);
+            return -EINVAL;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+int load_profile(struct ddriver *disk, struct ddriver_options *opts, struct ddriver_profile *profile) {
+    const char *name = getenv("DDRIVER_PROFILE");
+    const char *file = getenv("DDRIVER_PROFILE_FILE");
+    int i;
+
+    if (opts != NULL && opts->profile != NULL)
+        name = opts->profile;
+    if (opts != NULL && opts->profile_file != NULL)
+        file = opts->profile_file;
+
+    if (file != NULL && *file != '\0')
+        return load_profile_file(disk, file, profile);
+
+    if (name == NULL || *name == '\0')
+        name = CONFIG_PROFILE;
+    for (i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++) {
+        if (strcmp(profiles[i].name, name) == 0) {
+            *profile = profiles[i];
+            return 0;
+        }
+    }
+    user_panic(disk, "unknown device profile: %s", name);
+    return -EINVAL;
+}
+
+int sched_mode(const char *val) {
+    static const char *names[] = {"noop", "clook", "deadline"};
+    int i;
+
+    for (i = 0; i <= DDRIVER_SCHED_DEADLINE; i++) {
+        if (strcmp(val, names[i]) == 0)
+            return i;
+    }
+    return atoi(val);
+}
+
+int load_geometry(struct ddriver *disk, struct ddriver_options *opts) {
+    struct ddriver_profile profile;
+    struct ddriver_geometry geo;
+    long long wcache;
+    int sched;
+    int ret = load_profile(disk, opts, &profile);
+    if (ret < 0)
+        return ret;
+
+    geo.disk_size   = env_size("DDRIVER_DISK_SZ", CONFIG_DISK_SZ);
+    if (env_int(disk, "DDRIVER_IO_SZ", CONFIG_BLOCK_SZ, &geo.iounit_size) < 0 ||
+        env_int(disk, "DDRIVER_READ_LAT", profile.read_lat, &geo.read_lat) < 0 ||
+        env_int(disk, "DDRIVER_WRITE_LAT", profile.write_lat, &geo.write_lat) < 0 ||
+        env_int(disk, "DDRIVER_SEEK_LAT", profile.seek_lat, &geo.seek_lat) < 0 ||
+        env_int(disk, "DDRIVER_XFER_BW", profile.xfer_bw, &geo.xfer_bw) < 0 ||
+        env_int(disk, "DDRIVER_TRACK_NUM", 100, &geo.track_num) < 0 ||
+        env_int(disk, "DDRIVER_QUEUE_DEPTH", profile.queue_depth, &geo.queue_depth) < 0)
+        return -EINVAL;
+    sched           = getenv("DDRIVER_SCHED") ? sched_mode(getenv("DDRIVER_SCHED")) : 
+                                                DDRIVER_SCHED_NOOP;
+    wcache          = env_size("DDRIVER_WCACHE", 0);
+
+    if (opts != NULL) {
+        if (opts->geo.disk_size > 0)   geo.disk_size   = opts->geo.disk_size;
+        if (opts->geo.iounit_size > 0) geo.iounit_size = opts->geo.iounit_size;
+        if (opts->geo.read_lat > 0)    geo.read_lat    = opts->geo.read_lat;
+        if (opts->geo.write_lat > 0)   geo.write_lat   = opts->geo.write_lat;
+        if (opts->geo.seek_lat > 0)    geo.seek_lat    = opts->geo.seek_lat;
+        if (opts->geo.xfer_bw > 0)     geo.xfer_bw     = opts->geo.xfer_bw;
+        if (opts->geo.track_num > 0)   geo.track_num   = opts->geo.track_num;
+        if (opts->geo.queue_depth > 0) geo.queue_depth = opts->geo.queue_depth;
+        if (opts->sched_set)           sched           = opts->sched;
+        if (opts->wcache > 0)          wcache          = opts->wcache;
+    }
+
+    if (geo.iounit_size < CONFIG_BLOCK_SZ || 
+        (geo.iounit_size & (geo.iounit_size - 1)) != 0) {
+        user_panic(disk, "io size %d should be a power of 2 and at least %d", 
+                   geo.iounit_size, CONFIG_BLOCK_SZ);
+        return -EINVAL;
+    }
+    if (geo.disk_size <= 0 || geo.disk_size % geo.iounit_size != 0) {
+        user_panic(disk, "disk size %lld should align to io size %d", 
+                   geo.disk_size, geo.iounit_size);
+        return -EINVAL;
+    }
+    if (geo.read_lat < 0 || geo.write_lat < 0 || geo.seek_lat < 0 || 
+        geo.xfer_bw <= 0 || geo.track_num <= 0 || 
+        geo.queue_depth <= 0 || geo.queue_depth > CONFIG_QUEUE_DEPTH) {
+        user_panic(disk, "invalid latency model");
+        return -EINVAL;
+    }
+    if (sched < DDRIVER_SCHED_NOOP || sched > DDRIVER_SCHED_DEADLINE) {
+        user_panic(disk, "unknown scheduler %d", sched);
+        return -EINVAL;
+    }
+    if (wcache < 0 || wcache > geo.disk_size) {
+        user_panic(disk, "write cache size %lld out of range", wcache);
+        return -EINVAL;
+    }
+
+    disk->layout_size = geo.disk_size;
+    disk->iounit_size = geo.iounit_size;
+    disk->read_lat    = geo.read_lat;
+    disk->write_lat   = geo.write_lat;
+    disk->seek_lat    = geo.seek_lat;
+    disk->xfer_bw     = geo.xfer_bw;
+    disk->track_num   = geo.track_num;
+    disk->profile     = profile;
+    disk->profile.queue_depth = geo.queue_depth;
+    disk->vclock      = env_size("DDRIVER_VCLOCK", 0) != 0 || (opts != NULL && opts->vclock);
+    disk->direct      = env_size("DDRIVER_DIRECT", 0) != 0 || (opts != NULL && opts->direct);
+    disk->sched       = sched;
+    disk->wcache_blks = wcache / geo.iounit_size;
+    return 0;
+}
+
+uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t dev_now(struct ddriver *disk) {
+    return disk->vclock ? __atomic_load_n(&disk->vclock_us, __ATOMIC_RELAXED) : now_us();
+}
+
+void emulate_delay(struct ddriver *disk, uint64_t us) {
+    if (us == 0 || disk->backend->native_lat)
+        return;
+    if (disk->vclock)
+        STAT_ADD(disk->vclock_us, us);
+    else
+        usleep(us);
+}
+
+int stat_shard() {
+    static int next = 0;
+    static __thread int shard = -1;                  /* Threads spread round robin */
+
+    if (shard < 0)
+        shard = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) % CONFIG_STAT_SHARDS;
+    return shard;
+}
+
+void stat_merge(struct ddriver *disk, struct ddriver_state_v2 *out) {
+    unsigned long long *dst = (unsigned long long *)out;
+    unsigned long long *src;
+    int words = sizeof(struct ddriver_state_v2) / sizeof(unsigned long long);
+    int i, j;
+
+    memset(out, 0, sizeof(struct ddriver_state_v2));
+    for (i = 0; i < CONFIG_STAT_SHARDS; i++) {
+        src = (unsigned long long *)&disk->stat[i].st;
+        for (j = 0; j < words; j++)
+            dst[j] += __atomic_load_n(&src[j], __ATOMIC_RELAXED);
+    }
+    out->epoch    = __atomic_load_n(&disk->epoch, __ATOMIC_RELAXED);
+    out->epoch_us = __atomic_load_n(&disk->epoch_us, __ATOMIC_RELAXED);
+}
+
+int log2_bucket(uint64_t val) {
+    int bucket;
+    if (val == 0)
+        return 0;
+    bucket = 64 - __builtin_clzll(val);              /* [2^(b-1), 2^b) */
+    return bucket < DDRIVER_HIST_BUCKETS ? bucket : DDRIVER_HIST_BUCKETS - 1;
+}
+
+int arm_lat_us(struct ddriver *disk, off_t tracks) {
+    const struct ddriver_seek_point *curve = disk->profile.seek_curve;
+    int n = disk->profile.seek_points;
+    long long x = tracks * 1000;                     /* permille * track_num */
+    long long x0, x1;
+    int i;
+
+    if (tracks == 0 || n == 0)
+        return 0;
+    if (x >= (long long)curve[n - 1].permille * disk->track_num)
+        return curve[n - 1].lat;
+    for (i = 1; i < n; i++) {                        /* Linear interpolation */
+        x0 = (long long)curve[i - 1].permille * disk->track_num;
+        x1 = (long long)curve[i].permille * disk->track_num;
+        if (x < x1) {
+            return curve[i - 1].lat + 
+                   (curve[i].lat - curve[i - 1].lat) * (x - x0) / (x1 - x0);
+        }
+    }
+    return curve[0].lat;                             /* Track-to-track minimum */
+}
+
+int rotate_lat_us(struct ddriver *disk, off_t start, off_t end) {
+    off_t bytes_per_track = disk->layout_size / disk->track_num;
+    off_t lat_per_track = disk->seek_lat;
+    off_t distance = labs(end - start) % bytes_per_track; 
+    off_t tracks = labs(end / bytes_per_track - start / bytes_per_track);
+
+    return arm_lat_us(disk, tracks) + distance * lat_per_track / bytes_per_track;
+}
+
+uint64_t model_seek(struct ddriver *disk, off_t start, off_t end) {
+    if (start == end)
+        return 0;
+    struct ddriver_state_v2 *st = STAT_SHARD(disk);
+
+    STAT_ADD(st->seek_cnt, 1);
+    STAT_ADD(st->seek_dist_hist[log2_bucket(labs(end - start) / disk->iounit_size)], 1);
+    return rotate_lat_us(disk, start, end);
+}
+/**
+ * @brief 为写缓存分配脏块位图
+ */
+int wcache_init(struct ddriver *disk) {
+    long long nblks = disk->layout_size / disk->iounit_size;
+
+    if (disk->wcache_blks == 0)
+        return 0;
+    disk->wcache_map = calloc((nblks + 63) / 64, sizeof(uint64_t));
+    return disk->wcache_map == NULL ? -ENOMEM : 0;
+}
+/**
+ * @brief 标记[offset, offset + size)为干净，返回其中原本脏的块数。调用者持有wlock
+ */
+long long wcache_clean(struct ddriver *disk, off_t offset, off_t size) {
+    long long blk = offset / disk->iounit_size;
+    long long end = (offset + size) / disk->iounit_size;
+    long long cleaned = 0;
+
+    if (disk->wcache_map == NULL)
+        return 0;
+    for (; blk < end; blk++) {
+        if (WCACHE_TEST(disk, blk)) {
+            disk->wcache_map[blk / 64] &= ~(1ULL << (blk % 64));
+            cleaned++;
+        }
+    }
+    disk->wcache_dirty -= cleaned;
+    return cleaned;
+}
+/**
+ * @brief 回写全部脏块：从磁头处按C-LOOK顺序逐段写入，每段计一次寻道与写开销。
+ *        调用者持有wlock
+ * 
+ * @return uint64_t 回写的服务时间，us
+ */
+uint64_t wcache_destage(struct ddriver *disk) {
+    long long nblks = disk->layout_size / disk->iounit_size;
+    long long start = __atomic_load_n(&disk->head, __ATOMIC_RELAXED) / disk->iounit_size;
+    long long lo, hi, blk, run;
+    uint64_t lat = 0;
+    off_t cur;
+    int pass;
+
+    if (disk->wcache_dirty == 0)
+        return 0;
+    for (pass = 0; pass < 2; pass++) {
+        lo = pass == 0 ? start : 0;
+        hi = pass == 0 ? nblks : start;
+        for (blk = lo; blk < hi; ) {
+            if (blk % 64 == 0 && disk->wcache_map[blk / 64] == 0) {
+                blk += 64;                           /* Skip clean words */
+                continue;
+            }
+            if (!WCACHE_TEST(disk, blk)) {
+                blk++;
+                continue;
+            }
+            for (run = blk; run < hi && WCACHE_TEST(disk, run); run++)
+                ;
+            cur = MOVE_HEAD(disk, run * disk->iounit_size);
+            lat += model_seek(disk, cur, blk * disk->iounit_size) + 
+                   RW_LAT_US(disk, DDRIVER_OP_WRITE, (run - blk) * disk->iounit_size);
+            STAT_ADD(disk->cache_stat.destaged_bytes, (run - blk) * disk->iounit_size);
+            wcache_clean(disk, blk * disk->iounit_size, (run - blk) * disk->iounit_size);
+            blk = run;
+        }
+    }
+    STAT_ADD(disk->cache_stat.destage_us, lat);
+    return lat;
+}
+/**
+ * @brief 写入写缓存：只计接口传输时间，磁头不动。缓存写满时整体回写，
+ *        回写时间计入本次写
+ */
+uint64_t wcache_write(struct ddriver *disk, off_t offset, size_t size) {
+    long long blk = offset / disk->iounit_size;
+    long long end = (offset + size) / disk->iounit_size;
+    uint64_t lat = XFER_DELAY(disk, size);
+
+    pthread_mutex_lock(&disk->wlock);
+    for (; blk < end; blk++) {
+        if (!WCACHE_TEST(disk, blk)) {               /* Rewriting a dirty block is free */
+            disk->wcache_map[blk / 64] |= 1ULL << (blk % 64);
+            disk->wcache_dirty++;
+        }
+    }
+    if (disk->wcache_dirty > disk->wcache_blks) {
+        lat += wcache_destage(disk);
+        STAT_ADD(disk->cache_stat.destages, 1);
+    }
+    pthread_mutex_unlock(&disk->wlock);
+    STAT_ADD(disk->cache_stat.cached_writes, 1);
+    return lat;
+}
+/**
+ * @brief FLUSH：回写全部脏块，记入服务时间
+ * 
+ * @return uint64_t 回写的服务时间，us
+ */
+uint64_t wcache_flush(struct ddriver *disk) {
+    uint64_t lat;
+
+    if (disk->wcache_blks == 0)
+        return 0;
+    pthread_mutex_lock(&disk->wlock);
+    lat = wcache_destage(disk);
+    pthread_mutex_unlock(&disk->wlock);
+    STAT_ADD(disk->cache_stat.flushes, 1);
+    STAT_ADD(disk->service_us, lat);
+    return lat;
+}
+/**
+ * @brief 按延迟模型计算一次请求的服务时间并记入统计。
+ *        cur为请求到来时的磁头位置，调用者已用SEEK_HEAD原子地移动磁头；
+ *        进入写缓存的写只计传输时间，FUA写直达介质并使缓存中的对应块变干净
+ */
+uint64_t model_xfer(struct ddriver *disk, int op, off_t cur, off_t offset, size_t size) {
+    struct ddriver_op_stat *st = OP_STAT(STAT_SHARD(disk), op);
+    uint64_t lat;
+
+    if (WCACHE_HIT(disk, op)) {
+        lat = wcache_write(disk, offset, size);
+    }
+    else {
+        lat = model_seek(disk, cur, offset) + RW_LAT_US(disk, op, size);
+        if (disk->wcache_blks > 0 && IS_WRITE(op)) {
+            pthread_mutex_lock(&disk->wlock);
+            wcache_clean(disk, offset, size);
+            pthread_mutex_unlock(&disk->wlock);
+            STAT_ADD(disk->cache_stat.fua_writes, 1);
+        }
+    }
+
+    STAT_ADD(st->cnt, 1);
+    STAT_ADD(st->blks, size / disk->iounit_size);
+    STAT_ADD(st->bytes, size);
+    if (cur == offset)
+        STAT_ADD(st->seq_cnt, 1);
+    else
+        STAT_ADD(st->rand_cnt, 1);
+    STAT_ADD(st->lat_us, lat);
+    STAT_ADD(st->lat_hist[log2_bucket(lat)], 1);
+    STAT_ADD(disk->service_us, lat);
+    return lat;
+}
+/**
+ * @brief 按延迟模型计算一次请求的服务时间并记入统计，磁头移到请求末尾（写入缓存时不动）。
+ *        不睡眠：同步路径随后调用emulate_delay，异步路径记为完成时刻
+ */
+uint64_t model_io(struct ddriver *disk, int op, off_t offset, size_t size) {
+    off_t cur = SEEK_HEAD(disk, op, offset + size);
+    return model_xfer(disk, op, cur, offset, size);
+}
+
+void new_epoch(struct ddriver *disk) {
+    unsigned long long *words;
+    int i, j;
+
+    for (i = 0; i < CONFIG_STAT_SHARDS; i++) {
+        words = (unsigned long long *)&disk->stat[i].st;
+        for (j = 0; j < sizeof(struct ddriver_state_v2) / sizeof(unsigned long long); j++)
+            __atomic_store_n(&words[j], 0, __ATOMIC_RELAXED);
+    }
+    words = (unsigned long long *)&disk->sched_stat;
+    for (j = 0; j < sizeof(struct ddriver_sched_stat) / sizeof(unsigned long long); j++)
+        __atomic_store_n(&words[j], 0, __ATOMIC_RELAXED);
+    words = (unsigned long long *)&disk->cache_stat;
+    for (j = 0; j < sizeof(struct ddriver_cache_stat) / sizeof(unsigned long long); j++)
+        __atomic_store_n(&words[j], 0, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&disk->epoch, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&disk->epoch_us, dev_now(disk) - disk->open_us, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 分配O_DIRECT用的对齐缓冲池
+ */
+int bounce_init(struct ddriver *disk) {
+    int i;
+
+    for (i = 0; i < CONFIG_BOUNCE_BUFS; i++) {
+        if (posix_memalign((void **)&disk->bounce[i], CONFIG_DIO_ALIGN, CONFIG_BOUNCE_SZ) != 0)
+            return -ENOMEM;
+        disk->bounce_free |= 1ULL << i;
+    }
+    return 0;
+}
+
+void bounce_fini(struct ddriver *disk) {
+    int i;
+
+    for (i = 0; i < CONFIG_BOUNCE_BUFS; i++) {
+        free(disk->bounce[i]);
+        disk->bounce[i] = NULL;
+    }
+    disk->bounce_free = 0;
+}
+/**
+ * @brief 取一个空闲的对齐缓冲，池空时临时分配
+ */
+char *bounce_get(struct ddriver *disk) {
+    uint64_t free_map = __atomic_load_n(&disk->bounce_free, __ATOMIC_RELAXED);
+    char *buf;
+    int i;
+
+    while (free_map != 0) {
+        i = __builtin_ctzll(free_map);
+        if (__atomic_compare_exchange_n(&disk->bounce_free, &free_map, free_map & ~(1ULL << i), 
+                                        1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return disk->bounce[i];
+    }
+    if (posix_memalign((void **)&buf, CONFIG_DIO_ALIGN, CONFIG_BOUNCE_SZ) != 0)
+        return NULL;
+    return buf;
+}
+
+void bounce_put(struct ddriver *disk, char *buf) {
+    int i;
+
+    for (i = 0; i < CONFIG_BOUNCE_BUFS; i++) {
+        if (disk->bounce[i] == buf) {
+            __atomic_fetch_or(&disk->bounce_free, 1ULL << i, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+    free(buf);
+}
+/******************************************************************************
+* SECTION: Storage Backends
+*******************************************************************************/
+/**
+ * @brief file后端：打开（不存在时创建）镜像文件，并稀疏地扩展到设备大小。
+ *        设置了disk->direct时以O_DIRECT打开，不支持时退回缓冲IO
+ */
+int file_open(struct ddriver *disk, const char *path) {
+    struct stat st;
+    int fd, ret;
+
+    fd = open(path, O_CREAT | O_RDWR | (disk->direct ? O_DIRECT : 0), 0644);
+    if (fd < 0 && disk->direct && errno == EINVAL) {
+        disk->direct = 0;                            /* e.g. tmpfs, fall back to buffered */
+        fd = open(path, O_CREAT | O_RDWR, 0644);
+    }
+    if (fd < 0) {
+        ret = -errno;
+        user_panic(disk, "can't open device %s: %s", path, strerror(errno));
+        return ret;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size < disk->layout_size) {
+        ret = ftruncate(fd, disk->layout_size);      /* Grow sparsely, never shrink */
+        if (ret < 0) {
+            ret = -errno;
+            user_panic(disk, "low space");
+            close(fd);
+            return ret;
+        }
+    }
+    return fd;
+}
+
+int direct_open(struct ddriver *disk, const char *path) {
+    disk->direct = 1;
+    return file_open(disk, path);
+}
+
+int map_image(struct ddriver *disk, int fd) {
+    char *map = mmap(NULL, disk->layout_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int ret;
+
+    if (map == MAP_FAILED) {
+        ret = -errno;
+        user_panic(disk, "mmap error: %s", strerror(errno));
+        close(fd);
+        return ret;
+    }
+    disk->map = map;
+    return fd;
+}
+/**
+ * @brief mmap后端：打开镜像文件后整体映射，读写都是内存拷贝
+ */
+int mmap_open(struct ddriver *disk, const char *path) {
+    int fd = file_open(disk, path);
+    return fd < 0 ? fd : map_image(disk, fd);
+}
+/**
+ * @brief ram后端：设备放在匿名内存文件中，关闭即丢失，path只用于命名日志
+ */
+int ram_open(struct ddriver *disk, const char *path) {
+    int fd = memfd_create(DEVICE_NAME, MFD_CLOEXEC);
+    int ret;
+
+    IGNORE_ARG(path);
+    if (fd < 0 || ftruncate(fd, disk->layout_size) < 0) {
+        ret = -errno;
+        user_panic(disk, "can't create ram device: %s", strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return ret;
+    }
+    return map_image(disk, fd);
+}
+/**
+ * @brief kernel后端：打开内核ddriver字符设备（如/dev/ddriver），
+ *        设备大小与IO单位以内核模块为准，延迟由内核模块模拟
+ */
+int kernel_open(struct ddriver *disk, const char *path) {
+    long long size64;
+    int iounit;
+    int fd, ret;
+
+    fd = open(path, O_RDWR);
+    if (fd < 0) {
+        ret = -errno;
+        user_panic(disk, "can't open device %s: %s", path, strerror(errno));
+        return ret;
+    }
+    if (ioctl(fd, IOC_REQ_DEVICE_SIZE64, &size64) < 0 || 
+        ioctl(fd, IOC_REQ_DEVICE_IO_SZ, &iounit) < 0) {
+        ret = -errno;
+        user_panic(disk, "%s is not a ddriver device: %s", path, strerror(errno));
+        close(fd);
+        return ret;
+    }
+    if (size64 != disk->layout_size || iounit != disk->iounit_size)
+        user_info(disk, "%s: disk size %lld, io size %d, as loaded", path, size64, iounit);
+    disk->layout_size = size64;
+    disk->iounit_size = iounit;
+    return fd;
+}
+
+/**
+ * @brief file/direct/kernel后端：用preadv/pwritev在镜像与iov之间搬运数据。
+ *        O_DIRECT模式下未对齐的请求经缓冲池中转，按CONFIG_BOUNCE_SZ分段
+ * 
+ * @return ssize_t 搬运的字节数，失败返回-errno
+ */
+ssize_t file_rw(struct ddriver *disk, int op, const struct iovec *iov, int iovcnt, 
+               size_t total, off_t ofs) {
+    int fd = disk->ddriver_fd;
+    size_t done = 0, len, seg, skip = 0;
+    ssize_t ret;
+    char *bounce;
+    int i = 0, j;
+
+    if (!disk->direct || (iovcnt == 1 && IS_DIO_ALIGN(iov[0].iov_base))) {
+        ret = IS_WRITE(op) ? pwritev(fd, iov, iovcnt, ofs) : 
+                                       preadv(fd, iov, iovcnt, ofs);
+        return ret < 0 ? -errno : ret;
+    }
+
+    bounce = bounce_get(disk);
+    if (bounce == NULL)
+        return -ENOMEM;
+    while (done < total) {
+        len = MIN(total - done, CONFIG_BOUNCE_SZ);
+        if (IS_WRITE(op)) {                           /* Gather into the bounce buffer */
+            for (j = 0; j < len; j += seg, skip += seg) {
+                if (skip == iov[i].iov_len) {
+                    i++;
+                    skip = 0;
+                }
+                seg = MIN(len - j, iov[i].iov_len - skip);
+                memcpy(bounce + j, (char *)iov[i].iov_base + skip, seg);
+            }
+            ret = pwrite(fd, bounce, len, ofs + done);
+        }
+        else {
+            ret = pread(fd, bounce, len, ofs + done);
+            for (j = 0; ret > 0 && j < ret; j += seg, skip += seg) {
+                if (skip == iov[i].iov_len) {         /* Scatter to the caller */
+                    i++;
+                    skip = 0;
+                }
+                seg = MIN(ret - j, iov[i].iov_len - skip);
+                memcpy((char *)iov[i].iov_base + skip, bounce + j, seg);
+            }
+        }
+        if (ret < 0) {
+            ret = -errno;
+            bounce_put(disk, bounce);
+            return ret;
+        }
+        done += ret;
+        if (ret < len)
+            break;
+    }
+    bounce_put(disk, bounce);
+    return done;
+}
+
+/**
+ * @brief mmap/ram后端：在映射与iov之间拷贝，不进入内核
+ */
+ssize_t map_rw(struct ddriver *disk, int op, const struct iovec *iov, int iovcnt, 
+               size_t total, off_t ofs) {
+    int i;
+
+    assert(ofs >= 0 && ofs + (off_t)total <= disk->layout_size);
+    for (i = 0; i < iovcnt; i++) {
+        if (IS_WRITE(op))
+            memcpy(disk->map + ofs, iov[i].iov_base, iov[i].iov_len);
+        else
+            memcpy(iov[i].iov_base, disk->map + ofs, iov[i].iov_len);
+        ofs += iov[i].iov_len;
+    }
+    return total;
+}
+
+ssize_t dev_rw(struct ddriver *disk, int op, const struct iovec *iov, int iovcnt, 
+               size_t total, off_t ofs) {
+    return disk->backend->rw(disk, op, iov, iovcnt, total, ofs);
+}
+
+ssize_t dev_pwrite(struct ddriver *disk, const char *buf, size_t size, off_t ofs) {
+    struct iovec iov = { .iov_base = (char *)buf, .iov_len = size };
+    return dev_rw(disk, DDRIVER_OP_WRITE, &iov, 1, size, ofs);
+}
+
+ssize_t dev_pread(struct ddriver *disk, char *buf, size_t size, off_t ofs) {
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+    return dev_rw(disk, DDRIVER_OP_READ, &iov, 1, size, ofs);
+}
+
+/**
+ * @brief 打洞释放镜像中的块范围，不支持时清零
+ */
+int file_discard(struct ddriver *disk, off_t offset, off_t len) {
+    static const char zero[CONFIG_DIO_ALIGN] __attribute__((aligned(CONFIG_DIO_ALIGN)));
+    int     fd  = disk->ddriver_fd;
+    off_t   end = offset + len;
+    ssize_t n;
+
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0)
+        return 0;
+    if (errno != EOPNOTSUPP && errno != ENOSYS)
+        return -errno;
+    if (offset == 0 && end == disk->layout_size && disk->map == NULL) {
+        if (ftruncate(fd, 0) < 0 || ftruncate(fd, disk->layout_size) < 0)
+            return -errno;
+        return 0;
+    }
+    for (; offset < end; offset += n) {               /* Fallback: zero-fill */
+        n = end - offset < (off_t)sizeof(zero) ? end - offset : (off_t)sizeof(zero);
+        n = dev_pwrite(disk, zero, n, offset);
+        if (n < 0)
+            return n;
+    }
+    return 0;
+}
+
+int kernel_discard(struct ddriver *disk, off_t offset, off_t len) {
+    struct ddriver_discard discard = { .offset = offset, .len = len };
+    return ioctl(disk->ddriver_fd, IOC_REQ_DEVICE_DISCARD, &discard) < 0 ? -errno : 0;
+}
+
+int discard_range(struct ddriver *disk, off_t offset, off_t len) {
+    return disk->backend->discard(disk, offset, len);
+}
+/**
+ * @brief 写回并丢弃镜像在宿主机上的页缓存
+ */
+int file_drop_cache(struct ddriver *disk) {
+    int fd = disk->ddriver_fd;
+    int ret;
+
+    if (disk->map != NULL)
+        msync(disk->map, disk->layout_size, MS_SYNC);
+    if (fdatasync(fd) < 0)
+        return -errno;
+    ret = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    return -ret;
+}
+/**
+ * @brief 设备状态与统计以内核模块为准，批量请求一次进入内核；
+ *        RESET像用户态驱动一样先清零数据
+ */
+int kernel_ioctl(struct ddriver *disk, unsigned long cmd, void *arg) {
+    int ret;
+
+    switch (cmd)
+    {
+    case IOC_REQ_DEVICE_RESET:
+        ret = kernel_discard(disk, 0, disk->layout_size);
+        if (ret < 0)
+            return ret;
+        /* Fall through */
+    case IOC_REQ_DEVICE_GEOMETRY:
+    case IOC_REQ_DEVICE_SIM_TIME:
+    case IOC_REQ_DEVICE_STATE:
+    case IOC_REQ_DEVICE_STATE_V2:
+    case IOC_REQ_DEVICE_STATE_RESET:
+    case IOC_REQ_DEVICE_BATCH:
+        return ioctl(disk->ddriver_fd, cmd, arg) < 0 ? -errno : 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
+static const struct ddriver_backend backends[] = {
+    { .name = "file",   .open = file_open,   .rw = file_rw, .discard = file_discard, 
+      .drop_cache = file_drop_cache },
+    { .name = "direct", .open = direct_open, .rw = file_rw, .discard = file_discard, 
+      .drop_cache = file_drop_cache },
+    { .name = "mmap",   .open = mmap_open,   .rw = map_rw,  .discard = file_discard, 
+      .drop_cache = file_drop_cache },
+    { .name = "ram",    .open = ram_open,    .rw = map_rw,  .discard = file_discard },
+    { .name = "kernel", .open = kernel_open, .rw = file_rw, .discard = kernel_discard, 
+      .ioctl = kernel_ioctl, .native_lat = 1 }
+};
+/**
+ * @brief 选择后端：opts->backend > DDRIVER_BACKEND > 按路径推断，
+ *        字符设备用kernel，要求O_DIRECT时用direct，否则用file
+ */
+const struct ddriver_backend *find_backend(struct ddriver *disk, struct ddriver_options *opts, 
+                                           const char *path) {
+    const char *name = getenv("DDRIVER_BACKEND");
+    struct stat st;
+    int i;
+
+    if (opts != NULL && opts->backend != NULL)
+        name = opts->backend;
+    if (name == NULL || *name == '\0') {
+        if (stat(path, &st) == 0 && S_ISCHR(st.st_mode))
+            name = "kernel";
+        else
+            name = disk->direct ? "direct" : CONFIG_BACKEND;
+    }
+    for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (strcmp(backends[i].name, name) == 0)
+            return &backends[i];
+    }
+    user_panic(disk, "unknown backend: %s", name);
+    return NULL;
+}
+/******************************************************************************
+* SECTION: io_uring Engine
+*******************************************************************************/
+/* 
+ * ddriver_submit hands the data copy of fd based backends to an io_uring, so 
+ * the caller does not block on it. The raw syscalls are used, no liburing. 
+ * Kernels without io_uring (ENOSYS), with it disabled (EPERM), or older than 
+ * IORING_OP_READ/WRITE (5.6) keep the synchronous copy at submit time.
+ */
+void uring_fini(struct ddriver *disk) {
+    struct ddriver_uring *ring = &disk->uring;
+
+    if (ring->fd < 0)
+        return;
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_len);
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_len);
+    close(ring->fd);
+    ring->fd = -1;
+}
+/**
+ * @brief 为fd类后端建立io_uring，不可用时保持同步搬运
+ */
+int uring_setup(struct ddriver *disk) {
+    struct ddriver_uring *ring = &disk->uring;
+    struct io_uring_params p;
+    int fd;
+
+    if (disk->backend->rw != file_rw)                /* Mapped images copy in memcpy */
+        return 0;
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, CONFIG_QUEUE_DEPTH, &p);
+    if (fd < 0) {
+        user_info(disk, "io_uring unavailable (%s), async requests run synchronously", 
+                  strerror(errno));
+        return 0;
+    }
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) {    /* Appeared along with IORING_OP_READ */
+        user_info(disk, "io_uring too old, async requests run synchronously");
+        close(fd);
+        return 0;
+    }
+
+    ring->sq_len   = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring->sq_len = ring->cq_len = MAX(ring->sq_len, ring->cq_len);
+    ring->sq_ring = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+                         fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = (p.features & IORING_FEAT_SINGLE_MMAP) ? ring->sq_ring :
+                    mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+                         fd, IORING_OFF_CQ_RING);
+    ring->sqes    = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+                         fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        user_alert(disk, "io_uring mmap error, async requests run synchronously");
+        ring->fd = fd;
+        uring_fini(disk);
+        return 0;
+    }
+    ring->sq_head  = (unsigned *)((char *)ring->sq_ring + p.sq_off.head);
+    ring->sq_tail  = (unsigned *)((char *)ring->sq_ring + p.sq_off.tail);
+    ring->sq_mask  = (unsigned *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + p.sq_off.array);
+    ring->cq_head  = (unsigned *)((char *)ring->cq_ring + p.cq_off.head);
+    ring->cq_tail  = (unsigned *)((char *)ring->cq_ring + p.cq_off.tail);
+    ring->cq_mask  = (unsigned *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe *)((char *)ring->cq_ring + p.cq_off.cqes);
+    ring->entries  = p.sq_entries;
+    ring->fd       = fd;
+    return 0;
+}
+
+/**
+ * @brief 请求能否经io_uring搬运：O_DIRECT下未对齐的缓冲须经缓冲池中转，走同步路径
+ */
+int uring_usable(struct ddriver *disk, struct ddriver_req *req) {
+    return disk->uring.fd >= 0 && (!disk->direct || IS_DIO_ALIGN(req->buf));
+}
+/**
+ * @brief 为slot填一个SQE，不进入内核。调用者持有qlock，inflight未满保证SQ有空位
+ */
+void uring_queue(struct ddriver *disk, struct ddriver_inflight *slot, struct ddriver_req *req, 
+                 size_t size) {
+    struct ddriver_uring *ring = &disk->uring;
+    unsigned tail = *ring->sq_tail;
+    unsigned idx  = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode    = IS_WRITE(req->op) ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd        = disk->ddriver_fd;
+    sqe->addr      = (uintptr_t)req->buf;
+    sqe->len       = size;
+    sqe->off       = req->offset;
+    sqe->user_data = slot->id = ++ring->next_id;
+    slot->pending  = 1;
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+/**
+ * @brief 提交SQ中的全部SQE，min_complete > 0时等待CQ中至少有这么多完成项
+ */
+int uring_enter(struct ddriver *disk, unsigned min_complete) {
+    int ret;
+
+    do {
+        ret = syscall(__NR_io_uring_enter, disk->uring.fd, disk->uring.entries, min_complete, 
+                      min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret < 0 ? -errno : ret;
+}
+/**
+ * @brief 把CQ中的完成项记到对应的slot上。调用者持有uring.wait与qlock
+ */
+void uring_drain(struct ddriver *disk) {
+    struct ddriver_uring *ring = &disk->uring;
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    struct io_uring_cqe *cqe;
+    int i;
+
+    for (; head != tail; head++) {
+        cqe = &ring->cqes[head & *ring->cq_mask];
+        for (i = 0; i < disk->inflight_cnt; i++) {
+            if (disk->inflight[i].pending && disk->inflight[i].id == cqe->user_data) {
+                disk->inflight[i].res = cqe->res;
+                disk->inflight[i].pending = 0;
+                break;
+            }
+        }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+/**
+ * @brief 等待io_uring完成至少一个请求，或确认slot id已经完成。调用者持有qlock，
+ *        返回时仍持有。CQE只在持有uring.wait时消费，等待者因此不会错过唤醒
+ */
+void uring_wait(struct ddriver *disk, uint64_t id) {
+    int i, pending = 0;
+
+    pthread_mutex_unlock(&disk->qlock);
+    pthread_mutex_lock(&disk->uring.wait);
+    pthread_mutex_lock(&disk->qlock);
+    uring_drain(disk);
+    for (i = 0; i < disk->inflight_cnt; i++)
+        pending |= disk->inflight[i].pending && (id == 0 || disk->inflight[i].id == id);
+    pthread_mutex_unlock(&disk->qlock);
+    if (pending)
+        uring_enter(disk, 1);
+    pthread_mutex_lock(&disk->qlock);
+    pthread_mutex_unlock(&disk->uring.wait);
+}
+/**
+ * @brief 等待全部在途的io_uring请求完成数据搬运，完成项仍留待收割
+ */
+void uring_quiesce(struct ddriver *disk) {
+    int i, pending;
+
+    if (disk->uring.fd < 0)
+        return;
+    pthread_mutex_lock(&disk->qlock);
+    do {
+        for (i = 0, pending = 0; i < disk->inflight_cnt; i++)
+            pending |= disk->inflight[i].pending;
+        if (pending)
+            uring_wait(disk, 0);
+    } while (pending);
+    pthread_mutex_unlock(&disk->qlock);
+}
+/******************************************************************************
+* SECTION: Request Queue
+*******************************************************************************/
+/* 
+ * With a scheduler selected, ddriver_submit only queues requests. The queue is
+ * dispatched when it holds CONFIG_PLUG_DEPTH requests, when it is full, when a
+ * request conflicts with a queued one, and before reap or any synchronous I/O.
+ * Dispatch serves requests in C-LOOK order and merges contiguous runs of the
+ * same op into one device request, which pays seek and overhead only once.
+ */
+/**
+ * @brief 把一次服务时间记到最早空闲的通道上，返回完成时刻。调用者持有qlock
+ */
+uint64_t queue_charge(struct ddriver *disk, uint64_t now, uint64_t lat) {
+    int chan = 0, i;
+
+    for (i = 1; i < disk->profile.queue_depth; i++) {
+        if (disk->busy_until[i] < disk->busy_until[chan])
+            chan = i;
+    }
+    if (disk->busy_until[chan] < now)
+        disk->busy_until[chan] = now;
+    disk->busy_until[chan] += lat;
+    return disk->busy_until[chan];
+}
+/**
+ * @brief 请求与队列中的请求重叠且至少一个是写时，不能再调换二者的顺序。
+ *        调用者持有qlock
+ */
+int pending_conflict(struct ddriver *disk, struct ddriver_req *req) {
+    struct ddriver_req *queued;
+    int i;
+
+    for (i = 0; i < disk->pending_cnt; i++) {
+        queued = &disk->pending[i].req;
+        if ((IS_WRITE(queued->op) || IS_WRITE(req->op)) &&
+            queued->offset < REQ_END(disk, req) && req->offset < REQ_END(disk, queued))
+            return 1;
+    }
+    return 0;
+}
+/**
+ * @brief 排出服务顺序。DEADLINE下超时的请求按到达顺序最先服务，
+ *        其余按C-LOOK：从磁头处向高地址扫描，到底后回到最低地址
+ * 
+ * @return int 超时的请求数
+ */
+int sched_order(struct ddriver *disk, struct ddriver_pending *batch, int n, 
+                uint64_t now, int *order) {
+    off_t head = __atomic_load_n(&disk->head, __ATOMIC_RELAXED);
+    int rest[CONFIG_QUEUE_DEPTH];
+    int expired = 0, m = 0;
+    int i, j, wrap, tmp;
+
+    for (i = 0; i < n; i++) {
+        if (__atomic_load_n(&disk->sched, __ATOMIC_RELAXED) == DDRIVER_SCHED_DEADLINE && 
+            now - batch[i].arrive >= CONFIG_SCHED_EXPIRE_US)
+            order[expired++] = i;
+        else
+            rest[m++] = i;
+    }
+    if (expired > 0)
+        head = REQ_END(disk, &batch[order[expired - 1]].req);
+
+    for (i = 1; i < m; i++) {                        /* Insertion sort by offset, n is small */
+        tmp = rest[i];
+        for (j = i; j > 0 && batch[rest[j - 1]].req.offset > batch[tmp].req.offset; j--)
+            rest[j] = rest[j - 1];
+        rest[j] = tmp;
+    }
+    for (wrap = 0; wrap < m && batch[rest[wrap]].req.offset < head; wrap++)
+        ;
+    for (i = 0; i < m; i++)
+        order[expired + i] = rest[(wrap + i) % m];
+    return expired;
+}
+/**
+ * @brief 服务一批出队的请求，相邻且同向的请求合并为一次设备请求。
+ *        调用者已为这n个请求占用reserved
+ */
+void sched_dispatch(struct ddriver *disk, struct ddriver_pending *batch, int n) {
+    struct iovec iov[CONFIG_QUEUE_DEPTH];
+    struct ddriver_inflight *slot;
+    struct ddriver_req *req, *next;
+    int order[CONFIG_QUEUE_DEPTH];
+    uint64_t now = dev_now(disk);
+    uint64_t lat, deadline;
+    uint64_t seek_fifo = 0, seek_sched = 0;
+    size_t size;
+    ssize_t ret, left;
+    off_t cur;
+    int i, j, cnt, expired;
+
+    cur = __atomic_load_n(&disk->head, __ATOMIC_RELAXED);
+    for (i = 0; i < n; i++) {                        /* What arrival order would have cost */
+        if (WCACHE_HIT(disk, batch[i].req.op))
+            continue;                                /* Absorbed by the cache either way */
+        seek_fifo += labs(batch[i].req.offset - cur);
+        cur = REQ_END(disk, &batch[i].req);
+    }
+    expired = sched_order(disk, batch, n, now, order);
+
+    for (i = 0; i < n; i += cnt) {
+        req  = &batch[order[i]].req;
+        cnt  = 1;
+        size = 0;
+        lat  = 0;
+        ret  = check_valid_range(disk, req->offset, req->nblocks);
+        if (ret == 0) {
+            iov[0].iov_base = req->buf;
+            iov[0].iov_len  = (size_t)req->nblocks * disk->iounit_size;
+            size = iov[0].iov_len;
+            while (i + cnt < n) {                    /* Back merge contiguous requests */
+                next = &batch[order[i + cnt]].req;
+                if (next->op != req->op || next->offset != req->offset + size ||
+                    check_valid_range(disk, next->offset, next->nblocks) < 0)
+                    break;
+                iov[cnt].iov_base = next->buf;
+                iov[cnt].iov_len  = (size_t)next->nblocks * disk->iounit_size;
+                size += iov[cnt++].iov_len;
+            }
+            cur = SEEK_HEAD(disk, req->op, req->offset + size);
+            if (!WCACHE_HIT(disk, req->op))
+                seek_sched += labs(req->offset - cur);
+            lat = model_xfer(disk, req->op, cur, req->offset, size);
+            ret = dev_rw(disk, req->op, iov, cnt, size, req->offset);
+        }
+
+        pthread_mutex_lock(&disk->qlock);
+        disk->reserved -= cnt;
+        deadline = size > 0 && !disk->backend->native_lat ? queue_charge(disk, now, lat) : now;
+        for (j = 0, left = ret; j < cnt; j++) {      /* Split a short transfer in order */
+            slot = &disk->inflight[disk->inflight_cnt++];
+            slot->tag = batch[order[i + j]].req.tag;
+            slot->res = ret < 0 ? ret : MIN(left, (ssize_t)iov[j].iov_len);
+            slot->deadline = deadline;
+            slot->pending = 0;
+            if (ret >= 0)
+                left -= slot->res;
+        }
+        pthread_mutex_unlock(&disk->qlock);
+        if (cnt > 1)
+            STAT_ADD(disk->sched_stat.merged, cnt - 1);
+    }
+
+    STAT_ADD(disk->sched_stat.dispatched, n);
+    STAT_ADD(disk->sched_stat.expired, expired);
+    STAT_ADD(disk->sched_stat.seek_fifo, seek_fifo);
+    STAT_ADD(disk->sched_stat.seek_sched, seek_sched);
+    user_debug(disk, "dispatch %d requests, seek %llu -> %llu bytes", n, 
+               (unsigned long long)seek_fifo, (unsigned long long)seek_sched);
+}
+/**
+ * @brief 取出队列中的全部请求并服务。队列为空时不加锁直接返回
+ */
+void sched_unplug(struct ddriver *disk) {
+    struct ddriver_pending batch[CONFIG_QUEUE_DEPTH];
+    int n;
+
+    if (__atomic_load_n(&disk->pending_cnt, __ATOMIC_ACQUIRE) == 0)
+        return;
+    pthread_mutex_lock(&disk->qlock);
+    n = disk->pending_cnt;
+    memcpy(batch, disk->pending, n * sizeof(struct ddriver_pending));
+    disk->reserved += n;                             /* Keep the slots while served unlocked */
+    __atomic_store_n(&disk->pending_cnt, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&disk->qlock);
+    if (n > 0)
+        sched_dispatch(disk, batch, n);
+}
+/**
+ * @brief 将请求放入队列而不立即服务，返回入队的请求数
+ */
+int sched_submit(struct ddriver *disk, struct ddriver_req *reqs, int nr) {
+    uint64_t now = dev_now(disk);
+    int i = 0, full, plug;
+
+    while (i < nr) {
+        pthread_mutex_lock(&disk->qlock);
+        full = disk->inflight_cnt + disk->reserved + disk->pending_cnt == CONFIG_QUEUE_DEPTH;
+        if (full && disk->pending_cnt == 0) {
+            pthread_mutex_unlock(&disk->qlock);
+            break;
+        }
+        if (full || pending_conflict(disk, &reqs[i])) {
+            pthread_mutex_unlock(&disk->qlock);
+            sched_unplug(disk);                      /* Make room or keep the order */
+            continue;
+        }
+        disk->pending[disk->pending_cnt].req    = reqs[i];
+        disk->pending[disk->pending_cnt].arrive = now;
+        __atomic_store_n(&disk->pending_cnt, disk->pending_cnt + 1, __ATOMIC_RELEASE);
+        plug = disk->pending_cnt >= CONFIG_PLUG_DEPTH;
+        pthread_mutex_unlock(&disk->qlock);
+        i++;
+        if (plug)
+            sched_unplug(disk);
+    }
+    return i;
+}
+/******************************************************************************
+* SECTION: Log Ring
+*******************************************************************************/
+/* 
+ * Producers claim a slot by CAS on tail and publish it by storing seq, so the
+ * I/O path never blocks on the log file. Only the drainer touches head.
+ * reference: https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+ */
+void log_push(struct ddriver *disk, int level, const char *fmt, ...) {
+    struct ddriver_log_slot *slot;
+    uint64_t pos, seq;
+    va_list ap;
+    int len;
+
+    if (!__atomic_load_n(&disk->log.ready, __ATOMIC_ACQUIRE))
+        return;
+    pos = __atomic_load_n(&disk->log.tail, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &disk->log.ring[pos & (CONFIG_LOG_ENTRIES - 1)];
+        seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&disk->log.tail, &pos, pos + 1, 1, 
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if ((int64_t)(seq - pos) < 0) {          /* Full: drop, never wait */
+            __atomic_fetch_add(&disk->log.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else {
+            pos = __atomic_load_n(&disk->log.tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    va_start(ap, fmt);
+    len = vsnprintf(slot->msg, CONFIG_LOG_MSG_LEN, fmt, ap);
+    va_end(ap);
+    slot->len   = len < 0 ? 0 : (len >= CONFIG_LOG_MSG_LEN ? CONFIG_LOG_MSG_LEN - 1 : len);
+    slot->level = level;
+    slot->ts_us = now_us();
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    if (pos - __atomic_load_n(&disk->log.head, __ATOMIC_RELAXED) >= CONFIG_LOG_ENTRIES / 2)
+        pthread_cond_signal(&disk->log.kick);
+}
+
+void log_emit(struct ddriver *disk, uint64_t ts_us, int level, const char *msg, int len) {
+    struct ddriver_log_rec rec;
+
+    if (level >= DDRIVER_LOG_WARN)                   /* Echo what the user must see */
+        printf("%s" DEVICE_NAME " %.*s\n", log_prefix[level], len, msg);
+    if (disk->log.out == NULL)
+        return;
+    if (disk->log.binary) {
+        rec.ts_us = ts_us;
+        rec.level = level;
+        rec.len   = len;
+        rec.seq   = disk->log.written;
+        fwrite(&rec, sizeof(struct ddriver_log_rec), 1, disk->log.out);
+        fwrite(msg, 1, len, disk->log.out);
+    }
+    else {
+        fprintf(disk->log.out, "[%llu.%06llu] %s%.*s\n", 
+                (unsigned long long)ts_us / 1000000, (unsigned long long)ts_us % 1000000,
+                log_prefix[level], len, msg);
+    }
+    disk->log.written++;
+}
+
+void log_drain(struct ddriver *disk) {
+    struct ddriver_log_slot *slot;
+    uint64_t dropped;
+    char note[64];
+
+    pthread_mutex_lock(&disk->log.lock);
+    for (;;) {
+        slot = &disk->log.ring[disk->log.head & (CONFIG_LOG_ENTRIES - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != disk->log.head + 1)
+            break;
+        log_emit(disk, slot->ts_us, slot->level, slot->msg, slot->len);
+        __atomic_store_n(&slot->seq, disk->log.head + CONFIG_LOG_ENTRIES, __ATOMIC_RELEASE);
+        __atomic_store_n(&disk->log.head, disk->log.head + 1, __ATOMIC_RELAXED);
+    }
+    dropped = __atomic_load_n(&disk->log.dropped, __ATOMIC_RELAXED);
+    if (dropped != disk->log.reported) {
+        snprintf(note, sizeof(note), "log ring full, %llu records dropped", 
+                 (unsigned long long)(dropped - disk->log.reported));
+        log_emit(disk, now_us(), DDRIVER_LOG_WARN, note, strlen(note));
+        disk->log.reported = dropped;
+    }
+    if (disk->log.out != NULL)
+        fflush(disk->log.out);
+    pthread_mutex_unlock(&disk->log.lock);
+}
+
+void *log_drainer(void *arg) {
+    struct ddriver *disk = arg;
+    struct timespec ts;
+
+    pthread_mutex_lock(&disk->log.lock);
+    while (disk->log.running) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += CONFIG_LOG_DRAIN_US * 1000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&disk->log.kick, &disk->log.lock, &ts);
+        pthread_mutex_unlock(&disk->log.lock);
+        log_drain(disk);
+        pthread_mutex_lock(&disk->log.lock);
+    }
+    pthread_mutex_unlock(&disk->log.lock);
+    return NULL;
+}
+
+int log_level(const char *val) {
+    static const char *names[] = {"debug", "info", "warn", "panic"};
+    int i;
 
-#define CONFIG_DISK_SZ  (4 * 1024 * 1024)
-#define CONFIG_BLOCK_SZ (512)
-/******************************************************************************
-* SECTION: Macro Functions 
-*******************************************************************************/
-#define IGNORE_ARG(arg)         ((void)arg)
-#define IS_ADDR_ALIGN(addr)     (addr % CONFIG_BLOCK_SZ == 0)
-#define ADDR_ROUND_UP(addr)     ((addr / CONFIG_BLOCK_SZ) * CONFIG_BLOCK_SZ)
+    for (i = 0; i <= DDRIVER_LOG_PANIC; i++) {
+        if (strcmp(val, names[i]) == 0)
+            return i;
+    }
+    i = atoi(val);
+    return i < DDRIVER_LOG_DEBUG ? DDRIVER_LOG_DEBUG : 
+           (i > DDRIVER_LOG_PANIC ? DDRIVER_LOG_PANIC : i);
+}
+/**
+ * @brief 打开日志文件并启动后台drain线程。
+ *        DDRIVER_LOG_LEVEL: debug/info/warn/panic，低于此级别的日志不入队
+ *        DDRIVER_LOG_FORMAT: text（默认）或bin，bin格式见struct ddriver_log_rec
+ * 
+ * @param path 
+ * @return int 
+ */
+int log_start(struct ddriver *disk, const char *path) {
+    char *val;
+    uint32_t magic = DDRIVER_LOG_MAGIC;
+    int i;
 
-#define INC_READCNT(disk)       (disk.read_cnt++)
-#define INC_WRITECNT(disk)      (disk.write_cnt++)
-#define INC_SEEKCNT(disk)       (disk.seek_cnt++)
+    if (disk->log.ready)
+        return 0;
+    val = getenv("DDRIVER_LOG_LEVEL");
+    if (val != NULL && *val != '\0')
+        disk->log.level = log_level(val);
+    val = getenv("DDRIVER_LOG_FORMAT");
+    disk->log.binary = val != NULL && strcmp(val, "bin") == 0;
 
-#define RW_DELAY(disk, rw_ops)  (usleep(disk.rw_ops##_lat * 1000))
-/******************************************************************************
-* SECTION: Type definitions
-*******************************************************************************/
-struct ddriver
-{
-    int  ddriver_fd;                                 /* Disk ddriver_fd */
-    int  read_cnt;
-    int  write_cnt;
-    int  seek_cnt;
-    int  read_lat;
-    int  write_lat;
-    int  seek_lat;
-    int  track_num;
-    int  major_num;
-    int  layout_size;
-    int  iounit_size;
-};
-/******************************************************************************
-* SECTION: Global Variable
-*******************************************************************************/
-/* reference: https://en.wikipedia.org/wiki/Hard_disk_drive_performance_characteristics */
-struct ddriver disk = {
-    .read_cnt    = 0,
-    .write_cnt   = 0,
-    .seek_cnt    = 0,
-    .read_lat    = 2,       /* 2ms */       
-    .write_lat   = 1,       /* 1ms */
-    .seek_lat    = 4,       /* 4.17ms per 360 degree */
-    .major_num   = 0,
-    .track_num   = 100,
-    .layout_size = CONFIG_DISK_SZ,
-    .iounit_size = CONFIG_BLOCK_SZ
-};
+    disk->log.out = fopen(path, "w+");
+    if (disk->log.out == NULL)
+        return -1;
+    if (disk->log.binary)
+        fwrite(&magic, sizeof(uint32_t), 1, disk->log.out);
 
-FILE *debugf = NULL;
-/******************************************************************************
-* SECTION: Helper Functions
-*******************************************************************************/
-int check_valid(size_t size) {
-    if (size != CONFIG_BLOCK_SZ){
-        user_alert("io size %ld should align to %d", size, CONFIG_BLOCK_SZ);
-        return -EIO;
-    }
+    pthread_mutex_init(&disk->log.lock, NULL);
+    pthread_cond_init(&disk->log.kick, NULL);
+    for (i = 0; i < CONFIG_LOG_ENTRIES; i++)
+        disk->log.ring[i].seq = i;
+    disk->log.head = disk->log.tail = 0;
+    disk->log.dropped = disk->log.reported = disk->log.written = 0;
+    disk->log.running = 1;
+    if (pthread_create(&disk->log.drainer, NULL, log_drainer, disk) != 0)
+        disk->log.running = 0;                       /* Still drained at close */
+    __atomic_store_n(&disk->log.ready, 1, __ATOMIC_RELEASE);
     return 0;
 }
+/**
+ * @brief 停止drain线程，写出剩余日志并关闭日志文件
+ * 
+ * @return int 
+ */
+int log_stop(struct ddriver *disk) {
+    int ret;
 
-int emulate_rotate(int fd, off_t start, off_t end) {
-    int bytes_per_track = disk.layout_size / disk.track_num;
-    int lat_per_track = disk.seek_lat;
-    int distance = abs(end - start) % bytes_per_track; 
-    
-    if (distance == 0) {
+    if (!disk->log.ready)
         return 0;
+    __atomic_store_n(&disk->log.ready, 0, __ATOMIC_RELEASE);
+    if (disk->log.running) {
+        pthread_mutex_lock(&disk->log.lock);
+        disk->log.running = 0;
+        pthread_cond_signal(&disk->log.kick);
+        pthread_mutex_unlock(&disk->log.lock);
+        pthread_join(disk->log.drainer, NULL);
     }
+    log_drain(disk);
+    ret = fclose(disk->log.out);
+    disk->log.out = NULL;
+    pthread_cond_destroy(&disk->log.kick);
+    pthread_mutex_destroy(&disk->log.lock);
+    return ret;
+}
+/******************************************************************************
+* SECTION: Block I/O Trace
+*******************************************************************************/
+/**
+ * @brief 打开trace文件并写入文件头。记录是定长的struct ddriver_trace_rec，
+ *        必须无损，因此不走日志环，而是在锁内写入stdio缓冲
+ * 
+ * @param path 
+ * @return int 
+ */
+int trace_start(struct ddriver *disk, const char *path) {
+    struct ddriver_trace_hdr hdr;
 
-    usleep(distance * lat_per_track / bytes_per_track * 1000);
+    disk->trace = fopen(path, "wb");
+    if (disk->trace == NULL)
+        return -errno;
+    setvbuf(disk->trace, NULL, _IOFBF, 1 << 16);
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic       = DDRIVER_TRACE_MAGIC;
+    hdr.version     = DDRIVER_TRACE_VERSION;
+    hdr.rec_size    = sizeof(struct ddriver_trace_rec);
+    hdr.iounit_size = disk->iounit_size;
+    hdr.disk_size   = disk->layout_size;
+    memcpy(hdr.profile, disk->profile.name, DDRIVER_NAME_LEN);
+    fwrite(&hdr, sizeof(hdr), 1, disk->trace);
     return 0;
 }
+/**
+ * @brief 追加一条trace记录，时间戳取设备时钟，未开启trace时立即返回
+ * 
+ * @param op        DDRIVER_TRACE_*
+ * @param flags     DDRIVER_TRACE_FUA等
+ * @param offset    位置，IOCTL时为命令号
+ * @param nblocks 
+ */
+void trace_rec(struct ddriver *disk, int op, int flags, int64_t offset, uint32_t nblocks) {
+    struct ddriver_trace_rec rec;
+
+    if (disk->trace == NULL)
+        return;
+    rec.offset  = offset;
+    rec.tag     = trace_tag;
+    rec.nblocks = nblocks;
+    rec.op      = op;
+    rec.flags   = flags;
+    pthread_mutex_lock(&disk->tlock);                /* Stamp inside: keep records in order */
+    rec.ts_us   = dev_now(disk) - disk->open_us;
+    fwrite(&rec, sizeof(rec), 1, disk->trace);
+    pthread_mutex_unlock(&disk->tlock);
+}
+/**
+ * @brief 数据请求的trace记录，op为DDRIVER_OP_*，可带DDRIVER_OP_FUA
+ */
+void trace_io(struct ddriver *disk, int op, int flags, off_t offset, size_t size) {
+    if (disk->trace == NULL)
+        return;
+    if (op & DDRIVER_OP_FUA)
+        flags |= DDRIVER_TRACE_FUA;
+    trace_rec(disk, IS_WRITE(op) ? DDRIVER_TRACE_WRITE : DDRIVER_TRACE_READ, 
+              flags, offset, size / disk->iounit_size);
+}
+/**
+ * @brief 异步请求的trace记录，只记录被接受的nr个，队列满后重交的不会重复
+ */
+void trace_submit(struct ddriver *disk, struct ddriver_req *reqs, int nr) {
+    int i;
+
+    for (i = 0; disk->trace != NULL && i < nr; i++)
+        trace_io(disk, reqs[i].op, DDRIVER_TRACE_ASYNC, reqs[i].offset, 
+                 (size_t)reqs[i].nblocks * disk->iounit_size);
+}
+
+int trace_stop(struct ddriver *disk) {
+    int ret;
+
+    if (disk->trace == NULL)
+        return 0;
+    ret = fclose(disk->trace);
+    disk->trace = NULL;
+    return ret;
+}
 /******************************************************************************
 * SECTION: Global Function Implementation
 *******************************************************************************/
 /**
- * @brief 打开驱动
+ * @brief 按指定参数打开驱动。参数优先级：opts中非0字段 > 环境变量 > 默认值。
+ *        每次打开得到独立的设备实例（镜像、统计、延迟模型与日志），
+ *        以返回的fd区分，同一进程可同时驱动多个镜像
  * 
- * @return int 文件描述符
+ * @param path      磁盘镜像路径，不存在时创建；日志写入<path>_log，
+ *                  设置了opts->trace或DDRIVER_TRACE时记录块IO trace。
+ *                  存储后端由opts->backend或DDRIVER_BACKEND选择，见find_backend
+ * @param opts      可为NULL
+ * @return int 文件描述符，失败返回负的errno
  */
-int ddriver_open(char *path) {
+int ddriver_open_opts(char *path, struct ddriver_options *opts) {
+    struct ddriver *disk;
     int fd, ret = 0;
-    char device_path[128] = {0};
-    char log_path[128] = {0};
-    
-    sprintf(device_path, "%s/" DEVICE_NAME, getpwuid(getuid())->pw_dir);
-    sprintf(log_path, "%s/" DEVICE_LOG, getpwuid(getuid())->pw_dir);
-    
-    if (strcmp(device_path, path) != 0) {
-        user_panic("wrong path [%s], should be [%s]", path, device_path);
-        return -1;
+    char log_path[PATH_MAX] = {0};
+    const char *trace_path;
+
+    disk = disk_alloc();
+    if (disk == NULL) {
+        printf(USER_PANIC  " no memory for %s\n", path);
+        return -ENOMEM;
+    }
+    ret = load_geometry(disk, opts);
+    if (ret < 0) {
+        free(disk);
+        return ret;
     }
+    disk->open_us = dev_now(disk);
 
-    if (access(device_path, F_OK) == 0) {
-        fd = open(device_path, O_RDWR);
+    disk->backend = find_backend(disk, opts, path);
+    if (disk->backend == NULL) {
+        free(disk);
+        return -EINVAL;
     }
-    else {
-        fd = open(device_path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (disk->backend->open == kernel_open)          /* /dev is not writable */
+        snprintf(log_path, PATH_MAX, "%s/" DEVICE_NAME DEVICE_LOG, 
+                 getenv("HOME") != NULL ? getenv("HOME") : "/tmp");
+    else
+        snprintf(log_path, PATH_MAX, "%s" DEVICE_LOG, path);
+    if (log_start(disk, log_path) < 0) {              /* First, so the backend can log */
+        user_panic(disk, "can't init log: %s", log_path);
+        ret = -EIO;
+        goto out;
     }
+
+    disk->direct = 0;                                /* Only the direct backend sets it */
+    fd = disk->backend->open(disk, path);
     if (fd < 0) {
-        user_panic("can't open device: %d", fd);
-        return fd;
+        ret = fd;
+        goto out;
     }
-    ret = posix_fallocate(fd, 0, CONFIG_DISK_SZ);
-    if (ret < 0) {
-        user_panic("low space");
-        return ret;
+    disk->ddriver_fd = fd;
+    if (fd >= CONFIG_MAX_FDS) {
+        user_panic(disk, "too many open devices, fd %d", fd);
+        ret = -EMFILE;
+        goto out;
     }
 
-    debugf = fopen(log_path, "w+");
-    if (debugf == NULL) {
-        user_panic("can't init log: %s", log_path);
-        return -1;
+    if ((disk->direct && bounce_init(disk) < 0) || wcache_init(disk) < 0) {
+        user_panic(disk, "no memory for bounce buffers or write cache");
+        ret = -ENOMEM;
+        goto out;
     }
+    uring_setup(disk);
+    trace_path = opts != NULL && opts->trace != NULL ? opts->trace : getenv("DDRIVER_TRACE");
+    if (trace_path != NULL && *trace_path != '\0' && trace_start(disk, trace_path) < 0)
+        user_alert(disk, "can't open trace %s, tracing disabled", trace_path);
+    if (strcmp(disk->backend->name, "direct") == 0 && !disk->direct)
+        user_alert(disk, "O_DIRECT not supported for %s, using buffered I/O", path);
+    user_info(disk, "%s opened with %s backend", path, disk->backend->name);
 
+    __atomic_store_n(&disks[fd], disk, __ATOMIC_RELEASE);
     return fd;
+
+out:
+    if (disk->map != NULL)
+        munmap(disk->map, disk->layout_size);
+    if (disk->ddriver_fd >= 0)
+        close(disk->ddriver_fd);
+    bounce_fini(disk);
+    free(disk->wcache_map);
+    log_stop(disk);
+    free(disk);
+    return ret;
+}
+/**
+ * @brief 打开驱动，设备参数取默认值，可由DDRIVER_*环境变量覆盖
+ * 
+ * @return int 文件描述符
+ */
+int ddriver_open(char *path) {
+    return ddriver_open_opts(path, NULL);
 }
 /**
- * @brief 关闭驱动
+ * @brief 关闭驱动。不得与同一fd上的其他调用并发
  * 
  * @param fd 
  * @return int 
  */
 int ddriver_close(int fd) {
-    return close(fd) && fclose(debugf);
+    struct ddriver *disk = get_disk(fd);
+    int ret;
+
+    if (disk == NULL)
+        return -EBADF;
+    sched_unplug(disk);                              /* Queued writes must not be lost */
+    uring_quiesce(disk);                             /* The ring still uses the buffers */
+    uring_fini(disk);
+    if (disk->map != NULL) {
+        msync(disk->map, disk->layout_size, MS_SYNC);
+        munmap(disk->map, disk->layout_size);
+        disk->map = NULL;
+    }
+    __atomic_store_n(&disks[fd], NULL, __ATOMIC_RELEASE);
+    ret = close(fd);
+    if (log_stop(disk) != 0)                         /* Flush the log even if close failed */
+        ret = -1;
+    if (trace_stop(disk) != 0)
+        ret = -1;
+    bounce_fini(disk);
+    free(disk->wcache_map);
+    pthread_mutex_destroy(&disk->qlock);
+    pthread_mutex_destroy(&disk->wlock);
+    pthread_mutex_destroy(&disk->tlock);
+    pthread_mutex_destroy(&disk->uring.wait);
+    free(disk);
+    return ret;
 }
 /**
- * @brief 磁盘头SEEK
+ * @brief 设置ddriver_read/write的读写位置。和内核驱动的llseek一样，
+ *        这里不移动模拟磁头，也不计入seek_cnt和服务时间；
+ *        磁头在下一次IO时才移动，SEEK也在那时计数和计时
  * 
  * @param fd 
  * @param offset 
@@ -179,27 +1982,42 @@ int ddriver_close(int fd) {
  * @return int 
  */
 int ddriver_seek(int fd, off_t offset, int whence){
-    int ret = 0;
-    int cur = 0;
+    struct ddriver *disk = get_disk(fd);
+    off_t ret = 0;
 
-    if (!IS_ADDR_ALIGN(offset)) {
-        user_alert("offset %ld must be aligned to block size %d", 
-                      offset, CONFIG_BLOCK_SZ);
+    if (disk == NULL)
+        return -EBADF;
+    if (!IS_ADDR_ALIGN(disk, offset)) {
+        user_alert(disk, "offset %ld must be aligned to block size %d", 
+                      offset, disk->iounit_size);
         return -EINVAL;
     }
 
-    INC_SEEKCNT(disk);
-    cur = lseek(fd, 0, SEEK_CUR);
-    ret = lseek(fd, offset, whence);
-    if (ret < 0) {
-        user_panic("seek error: %s", strerror(errno));
-        return ret;
+    switch (whence)                                  /* fd offset unused */
+    {
+    case SEEK_SET:
+        ret = offset;
+        break;
+    case SEEK_CUR:
+        ret = __atomic_load_n(&disk->pos, __ATOMIC_RELAXED) + offset;
+        break;
+    case SEEK_END:
+        ret = disk->layout_size + offset;
+        break;
+    default:
+        return -EINVAL;
+    }
+    if (ret < 0 || ret > disk->layout_size) {
+        user_alert(disk, "seek to %ld out of disk", ret);
+        return -EINVAL;
     }
-    emulate_rotate(fd, cur, ret);
+    trace_rec(disk, DDRIVER_TRACE_SEEK, 0, ret, 0);
+    __atomic_store_n(&disk->pos, ret, __ATOMIC_RELAXED);
     return ret;
 }
 /**
- * @brief 磁盘写入，写入大小可通过IOCTL查询
+ * @brief 磁盘写入，写入大小可通过IOCTL查询。
+ *        原子地占用读写位置处的块，多线程并发调用时各自写入不同的块
  * 
  * @param fd 
  * @param buf 
@@ -207,15 +2025,29 @@ int ddriver_seek(int fd, off_t offset, int whence){
  * @return int 
  */
 int ddriver_write(int fd, char *buf, size_t size){
-    int res = check_valid(size);
+    struct ddriver *disk = get_disk(fd);
+    ssize_t ret;
+    off_t ofs;
+    int res;
+
+    if (disk == NULL)
+        return -EBADF;
+    res = check_valid(disk, size);
     if(res < 0)
         return res;
+    sched_unplug(disk);                              /* Don't overtake queued requests */
         
-    RW_DELAY(disk, write);
-    write(fd, buf, size);
-
-    INC_WRITECNT(disk);
-    return CONFIG_BLOCK_SZ;
+    res = claim_pos(disk, size, &ofs);               /* Claim the block at pos */
+    if (res < 0)
+        return res;
+    trace_io(disk, DDRIVER_OP_WRITE, DDRIVER_TRACE_HEAD, ofs, size);
+    emulate_delay(disk, model_io(disk, DDRIVER_OP_WRITE, ofs, size));
+    ret = dev_pwrite(disk, buf, size, ofs);
+    if (ret < 0) {
+        user_panic(disk, "write error: %s", strerror(-ret));
+        return ret;
+    }
+    return disk->iounit_size;
 }
 /**
  * @brief 
@@ -226,15 +2058,416 @@ int ddriver_write(int fd, char *buf, size_t size){
  * @return int 
  */
 int ddriver_read(int fd, char *buf, size_t size){
-    int res = check_valid(size);
+    struct ddriver *disk = get_disk(fd);
+    ssize_t ret;
+    off_t ofs;
+    int res;
+
+    if (disk == NULL)
+        return -EBADF;
+    res = check_valid(disk, size);
     if(res < 0)
         return res;
+    sched_unplug(disk);                              /* Don't overtake queued requests */
+
+    res = claim_pos(disk, size, &ofs);               /* Claim the block at pos */
+    if (res < 0)
+        return res;
+    trace_io(disk, DDRIVER_OP_READ, DDRIVER_TRACE_HEAD, ofs, size);
+    emulate_delay(disk, model_io(disk, DDRIVER_OP_READ, ofs, size));
+    ret = dev_pread(disk, buf, size, ofs);
+    if (ret < 0) {
+        user_panic(disk, "read error: %s", strerror(-ret));
+        return ret;
+    }
+    return disk->iounit_size;
+}
+/**
+ * @brief 磁盘批量写入，一次请求写入多个连续块
+ * 
+ * @param fd 
+ * @param iov       每段大小须为块大小的整数倍
+ * @param iovcnt 
+ * @return int      写入的字节数
+ */
+int ddriver_writev(int fd, const struct iovec *iov, int iovcnt) {
+    struct ddriver *disk = get_disk(fd);
+    size_t total;
+    ssize_t ret;
+    off_t ofs;
+    int res;
+
+    if (disk == NULL)
+        return -EBADF;
+    res = check_valid_vec(disk, iov, iovcnt, &total);
+    if (res < 0)
+        return res;
+    sched_unplug(disk);                              /* Don't overtake queued requests */
+
+    res = claim_pos(disk, total, &ofs);
+    if (res < 0)
+        return res;
+    trace_io(disk, DDRIVER_OP_WRITE, DDRIVER_TRACE_HEAD, ofs, total);
+    emulate_delay(disk, model_io(disk, DDRIVER_OP_WRITE, ofs, total));
+    ret = dev_rw(disk, DDRIVER_OP_WRITE, iov, iovcnt, total, ofs); /* Charged once per request */
+    if (ret < 0) {
+        user_panic(disk, "writev error: %s", strerror(-ret));
+        return ret;
+    }
+    return ret;
+}
+/**
+ * @brief 磁盘批量读出，一次请求读出多个连续块
+ * 
+ * @param fd 
+ * @param iov       每段大小须为块大小的整数倍
+ * @param iovcnt 
+ * @return int      读出的字节数
+ */
+int ddriver_readv(int fd, const struct iovec *iov, int iovcnt) {
+    struct ddriver *disk = get_disk(fd);
+    size_t total;
+    ssize_t ret;
+    off_t ofs;
+    int res;
+
+    if (disk == NULL)
+        return -EBADF;
+    res = check_valid_vec(disk, iov, iovcnt, &total);
+    if (res < 0)
+        return res;
+    sched_unplug(disk);                              /* Don't overtake queued requests */
+
+    res = claim_pos(disk, total, &ofs);
+    if (res < 0)
+        return res;
+    trace_io(disk, DDRIVER_OP_READ, DDRIVER_TRACE_HEAD, ofs, total);
+    emulate_delay(disk, model_io(disk, DDRIVER_OP_READ, ofs, total));
+    ret = dev_rw(disk, DDRIVER_OP_READ, iov, iovcnt, total, ofs); /* Charged once per request */
+    if (ret < 0) {
+        user_panic(disk, "readv error: %s", strerror(-ret));
+        return ret;
+    }
+    return ret;
+}
+/**
+ * @brief 定位写入，op可带DDRIVER_OP_FUA
+ */
+int pwrite_op(int fd, int op, char *buf, int nblocks, off_t offset) {
+    struct ddriver *disk = get_disk(fd);
+    size_t size;
+    ssize_t ret;
+    int res;
+
+    if (disk == NULL)
+        return -EBADF;
+    size = (size_t)nblocks * disk->iounit_size;
+    res  = check_valid_range(disk, offset, nblocks);
+    if (res < 0)
+        return res;
+    sched_unplug(disk);                              /* Don't overtake queued requests */
+
+    trace_io(disk, op, 0, offset, size);
+    emulate_delay(disk, model_io(disk, op, offset, size));
+    ret = dev_pwrite(disk, buf, size, offset);
+    if (ret < 0) {
+        user_panic(disk, "pwrite error: %s", strerror(-ret));
+        return ret;
+    }
+    return ret;
+}
+/**
+ * @brief 定位写入，不依赖也不改变fd的读写位置。
+ *        磁头移动的寻道代价并入本次请求，磁头不动时不计SEEK；
+ *        开启写缓存时写入缓存即返回
+ * 
+ * @param fd 
+ * @param buf 
+ * @param nblocks   写入块数
+ * @param offset    须与块大小对齐
+ * @return int      写入的字节数
+ */
+int ddriver_pwrite(int fd, char *buf, int nblocks, off_t offset) {
+    return pwrite_op(fd, DDRIVER_OP_WRITE, buf, nblocks, offset);
+}
+/**
+ * @brief FUA定位写入：绕过写缓存，返回时数据已在介质上
+ * 
+ * @param fd 
+ * @param buf 
+ * @param nblocks   写入块数
+ * @param offset    须与块大小对齐
+ * @return int      写入的字节数
+ */
+int ddriver_pwrite_fua(int fd, char *buf, int nblocks, off_t offset) {
+    return pwrite_op(fd, DDRIVER_OP_WRITE | DDRIVER_OP_FUA, buf, nblocks, offset);
+}
+/**
+ * @brief 定位读出，不依赖也不改变fd的读写位置。
+ *        磁头移动的寻道代价并入本次请求，磁头不动时不计SEEK
+ * 
+ * @param fd 
+ * @param buf 
+ * @param nblocks   读出块数
+ * @param offset    须与块大小对齐
+ * @return int      读出的字节数
+ */
+int ddriver_pread(int fd, char *buf, int nblocks, off_t offset) {
+    struct ddriver *disk = get_disk(fd);
+    size_t size;
+    ssize_t ret;
+    int res;
+
+    if (disk == NULL)
+        return -EBADF;
+    size = (size_t)nblocks * disk->iounit_size;
+    res  = check_valid_range(disk, offset, nblocks);
+    if (res < 0)
+        return res;
+    sched_unplug(disk);                              /* Don't overtake queued requests */
+
+    trace_io(disk, DDRIVER_OP_READ, 0, offset, size);
+    emulate_delay(disk, model_io(disk, DDRIVER_OP_READ, offset, size));
+    ret = dev_pread(disk, buf, size, offset);
+    if (ret < 0) {
+        user_panic(disk, "pread error: %s", strerror(-ret));
+        return ret;
+    }
+    return ret;
+}
+/**
+ * @brief 异步提交一批请求。file/direct/kernel后端的数据经io_uring搬运，一次进入内核
+ *        提交整批，io_uring不可用时以及mmap/ram后端在提交时同步搬运；每个请求按延迟模型
+ *        计算完成时刻（设备按profile的队列深度并行服务），调用者无需睡眠，
+ *        由ddriver_reap收割。
+ *        选择了调度策略时请求先进入队列，出队时才搬运数据。buf须保持有效至收割
+ * 
+ * @param fd 
+ * @param reqs 
+ * @param nr 
+ * @return int      成功提交的请求数，队列满时可能少于nr
+ */
+int ddriver_submit(int fd, struct ddriver_req *reqs, int nr) {
+    struct ddriver *disk = get_disk(fd);
+    struct ddriver_inflight *slot;
+    struct ddriver_req *req;
+    uint64_t now;
+    uint64_t lat;
+    size_t size;
+    ssize_t ret;
+    int i, async, queued = 0;
+
+    if (disk == NULL)
+        return -EBADF;
+    if (__atomic_load_n(&disk->sched, __ATOMIC_RELAXED) != DDRIVER_SCHED_NOOP) {
+        i = sched_submit(disk, reqs, nr);
+        trace_submit(disk, reqs, i);
+        return i;
+    }
+    now = dev_now(disk);
+    for (i = 0; i < nr; i++) {
+        pthread_mutex_lock(&disk->qlock);            /* Reserve a slot, I/O runs unlocked */
+        if (disk->inflight_cnt + disk->reserved == CONFIG_QUEUE_DEPTH) {
+            pthread_mutex_unlock(&disk->qlock);
+            break;
+        }
+        disk->reserved++;
+        pthread_mutex_unlock(&disk->qlock);
+
+        req   = &reqs[i];
+        lat   = 0;
+        size  = 0;
+        ret   = check_valid_range(disk, req->offset, req->nblocks);
+        async = ret == 0 && uring_usable(disk, req);
+        if (ret == 0) {
+            size = (size_t)req->nblocks * disk->iounit_size;
+            lat  = model_io(disk, req->op, req->offset, size);
+            if (async)
+                ;                                    /* Queued to the ring below */
+            else if (IS_WRITE(req->op))
+                ret = dev_pwrite(disk, req->buf, size, req->offset);
+            else
+                ret = dev_pread(disk, req->buf, size, req->offset);
+        }
+
+        pthread_mutex_lock(&disk->qlock);
+        disk->reserved--;
+        slot = &disk->inflight[disk->inflight_cnt++];
+        slot->tag = req->tag;
+        slot->res = ret;
+        slot->pending = 0;
+        slot->deadline = size > 0 && !disk->backend->native_lat ?   /* Else the device waited */
+                         queue_charge(disk, now, lat) : now;
+        if (async) {
+            uring_queue(disk, slot, req, size);
+            queued++;
+        }
+        pthread_mutex_unlock(&disk->qlock);
+    }
+    if (queued > 0 && (ret = uring_enter(disk, 0)) < 0)   /* Left in the SQ, reap retries */
+        user_alert(disk, "io_uring submit error: %s", strerror(-ret));
+    trace_submit(disk, reqs, i);
+    return i;
+}
+/**
+ * @brief 收割已完成的异步请求，按完成时刻先后返回。
+ *        请求在模拟的完成时刻到达且数据搬运完成后才算完成；
+ *        自己模拟延迟的后端（kernel）在提交时已付过延迟，只等数据
+ * 
+ * @param fd 
+ * @param cqes 
+ * @param nr            最多返回nr个
+ * @param min_complete  至少等待min_complete个请求完成
+ * @return int          返回的完成数
+ */
+int ddriver_reap(int fd, struct ddriver_cqe *cqes, int nr, int min_complete) {
+    struct ddriver *disk = get_disk(fd);
+    struct ddriver_inflight done;
+    uint64_t now, wait;
+    int cnt = 0;
+    int i, first;
+
+    if (disk == NULL)
+        return -EBADF;
+    sched_unplug(disk);                              /* Queued requests can't complete otherwise */
+    if (disk->uring.fd >= 0 && pthread_mutex_trylock(&disk->uring.wait) == 0) {
+        pthread_mutex_lock(&disk->qlock);            /* Else a waiter drains it */
+        uring_drain(disk);
+        pthread_mutex_unlock(&disk->qlock);
+        pthread_mutex_unlock(&disk->uring.wait);
+    }
+    pthread_mutex_lock(&disk->qlock);
+    if (min_complete > disk->inflight_cnt)
+        min_complete = disk->inflight_cnt;
+    
+    while (cnt < nr && disk->inflight_cnt > 0) {
+        first = 0;                                    /* Earliest deadline */
+        for (i = 1; i < disk->inflight_cnt; i++) {
+            if (disk->inflight[i].deadline < disk->inflight[first].deadline)
+                first = i;
+        }
+        
+        now = dev_now(disk);
+        if (!disk->backend->native_lat && disk->inflight[first].deadline > now) {
+            if (cnt >= min_complete)
+                break;
+            wait = disk->inflight[first].deadline - now;
+            pthread_mutex_unlock(&disk->qlock);       /* Don't block submitters while waiting */
+            emulate_delay(disk, wait);
+            pthread_mutex_lock(&disk->qlock);
+            continue;                                 /* Rescan, others may have reaped */
+        }
+        if (disk->inflight[first].pending) {          /* Due, but the data is still moving */
+            if (cnt >= min_complete)
+                break;
+            uring_wait(disk, disk->inflight[first].id);
+            continue;
+        }
+
+        done = disk->inflight[first];
+        disk->inflight[first] = disk->inflight[--disk->inflight_cnt];
+        cqes[cnt].tag = done.tag;
+        cqes[cnt].res = done.res;
+        cnt++;
+    }
+    pthread_mutex_unlock(&disk->qlock);
+    return cnt;
+}
+/**
+ * @brief 将磁盘镜像映射进内存，此后可通过ddriver_map_read/ddriver_map_write
+ *        直接访问块而无需拷贝
+ * 
+ * @param fd 
+ * @return int 
+ */
+int ddriver_mmap(int fd) {
+    struct ddriver *disk = get_disk(fd);
+    char *expected = NULL;
+    char *map;
+
+    if (disk == NULL)
+        return -EBADF;
+    if (__atomic_load_n(&disk->map, __ATOMIC_ACQUIRE) != NULL)
+        return 0;
+
+    map = mmap(NULL, disk->layout_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        user_panic(disk, "mmap error: %s", strerror(errno));
+        return -errno;
+    }
+    if (!__atomic_compare_exchange_n(&disk->map, &expected, map, 0, 
+                                     __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+        munmap(map, disk->layout_size);              /* Another thread mapped first */
+    return 0;
+}
+/**
+ * @brief 取得映射中的块用于读，计读延迟与读计数
+ * 
+ * @param fd 
+ * @param nblocks 
+ * @param offset    须与块大小对齐
+ * @return char*    指向镜像中offset处的指针，失败返回NULL
+ */
+char *ddriver_map_read(int fd, int nblocks, off_t offset) {
+    struct ddriver *disk = get_disk(fd);
+    size_t size;
+
+    if (disk == NULL)
+        return NULL;
+    size = (size_t)nblocks * disk->iounit_size;
+    if (disk->map == NULL || check_valid_range(disk, offset, nblocks) < 0)
+        return NULL;
+    sched_unplug(disk);
+
+    trace_io(disk, DDRIVER_OP_READ, DDRIVER_TRACE_MAP, offset, size);
+    emulate_delay(disk, model_io(disk, DDRIVER_OP_READ, offset, size));
+    return disk->map + offset;
+}
+/**
+ * @brief 取得映射中的块用于写，计写延迟与写计数。
+ *        写入的内容在ddriver_flush或ddriver_close后保证落盘
+ * 
+ * @param fd 
+ * @param nblocks 
+ * @param offset    须与块大小对齐
+ * @return char*    指向镜像中offset处的指针，失败返回NULL
+ */
+char *ddriver_map_write(int fd, int nblocks, off_t offset) {
+    struct ddriver *disk = get_disk(fd);
+    size_t size;
 
-    RW_DELAY(disk, read);
-    read(fd, buf, size);
+    if (disk == NULL)
+        return NULL;
+    size = (size_t)nblocks * disk->iounit_size;
+    if (disk->map == NULL || check_valid_range(disk, offset, nblocks) < 0)
+        return NULL;
+    sched_unplug(disk);
+
+    trace_io(disk, DDRIVER_OP_WRITE, DDRIVER_TRACE_MAP, offset, size);
+    emulate_delay(disk, model_io(disk, DDRIVER_OP_WRITE, offset, size));
+    return disk->map + offset;
+}
+/**
+ * @brief 设备FLUSH：服务完排队与io_uring中在途的请求，将映射中的修改写回镜像，
+ *        再回写写缓存中的全部脏块，等待回写完成
+ * 
+ * @param fd 
+ * @return int 
+ */
+int ddriver_flush(int fd) {
+    struct ddriver *disk = get_disk(fd);
 
-    INC_READCNT(disk);
-    return CONFIG_BLOCK_SZ;
+    if (disk == NULL)
+        return -EBADF;
+    trace_rec(disk, DDRIVER_TRACE_FLUSH, 0, 0, 0);
+    sched_unplug(disk);
+    uring_quiesce(disk);
+    if (disk->map != NULL && msync(disk->map, disk->layout_size, MS_SYNC) < 0) {
+        user_panic(disk, "msync error: %s", strerror(errno));
+        return -errno;
+    }
+    emulate_delay(disk, wcache_flush(disk));
+    return 0;
 }
 /**
  * @brief 
@@ -245,32 +2478,170 @@ int ddriver_read(int fd, char *buf, size_t size){
  * @return int 
  */
 int ddriver_ioctl(int fd, unsigned long cmd, void *arg){
+    struct ddriver *disk = get_disk(fd);
     struct ddriver_state state;
+    struct ddriver_state_v2 stat;
+    struct ddriver_geometry geo;
+    struct ddriver_sim_time sim;
+    struct ddriver_discard discard;
+    struct ddriver_cache_stat cache;
+    struct ddriver_batch batch;
+    struct ddriver_batch_ent *ent;
+    unsigned long long *words;
+    long long size64;
+    int size, i;
+    int ret;
+
+    if (disk == NULL)
+        return -EBADF;
+    if (cmd != IOC_REQ_DEVICE_FLUSH && cmd != IOC_REQ_DEVICE_DISCARD && 
+        cmd != IOC_REQ_DEVICE_TRACE_TAG && cmd != IOC_REQ_DEVICE_BATCH)  /* Those are traced as their own ops */
+        trace_rec(disk, DDRIVER_TRACE_IOCTL, 0, cmd, 0);
+    if (cmd == IOC_REQ_DEVICE_RESET || cmd == IOC_REQ_DEVICE_DISCARD)
+        uring_quiesce(disk);                          /* Don't let in-flight writes land after */
+    if (disk->backend->ioctl != NULL) {               /* The device answers for itself */
+        sched_unplug(disk);
+        ret = disk->backend->ioctl(disk, cmd, arg);
+        if (ret != -ENOTTY)
+            return ret;
+    }
     switch (cmd)
     {
-    case IOC_REQ_DEVICE_SIZE:                         /* Device Size */
-        memcpy(arg, &disk.layout_size, sizeof(int));
+    case IOC_REQ_DEVICE_SIZE:                         /* Device Size, clamped to int */
+        size = disk->layout_size > INT_MAX ? 
+               ADDR_ROUND_UP(disk, INT_MAX) : disk->layout_size;
+        memcpy(arg, &size, sizeof(int));
+        break;
+    case IOC_REQ_DEVICE_SIZE64:                       /* Device Size, 64 bits */
+        size64 = disk->layout_size;
+        memcpy(arg, &size64, sizeof(long long));
+        break;
+    case IOC_REQ_DEVICE_GEOMETRY:                     /* Device Geometry */
+        geo.disk_size   = disk->layout_size;
+        geo.iounit_size = disk->iounit_size;
+        geo.read_lat    = disk->read_lat;
+        geo.write_lat   = disk->write_lat;
+        geo.seek_lat    = disk->seek_lat;
+        geo.xfer_bw     = disk->xfer_bw;
+        geo.track_num   = disk->track_num;
+        geo.queue_depth = disk->profile.queue_depth;
+        memcpy(geo.profile, disk->profile.name, DDRIVER_NAME_LEN);
+        memcpy(arg, &geo, sizeof(struct ddriver_geometry));
+        break;
+    case IOC_REQ_DEVICE_SIM_TIME:                     /* Emulated Device Time */
+        sim.service_us = __atomic_load_n(&disk->service_us, __ATOMIC_RELAXED);
+        sim.clock_us   = dev_now(disk) - disk->open_us;
+        memcpy(arg, &sim, sizeof(struct ddriver_sim_time));
         break;
     case IOC_REQ_DEVICE_STATE:                        /* Device State */
-        state.read_cnt = disk.read_cnt;
-        state.write_cnt = disk.write_cnt;
-        state.seek_cnt = disk.seek_cnt;
+        stat_merge(disk, &stat);
+        state.read_cnt = stat.read.blks;             /* Truncated, see V2 */
+        state.write_cnt = stat.write.blks;
+        state.seek_cnt = stat.seek_cnt;
         memcpy(arg, &state, sizeof(struct ddriver_state));
         break;
     case IOC_REQ_DEVICE_RESET:                        /* Reset Device */
-        lseek(fd, 0, SEEK_SET);
-        char buf[4096] = {'\0'};
-        for (size_t i = 0; i < CONFIG_DISK_SZ; i += 4096)
-        {
-            write(fd, buf, 4096);
-        }
-        lseek(fd, 0, SEEK_SET);
-        disk.read_cnt = 0;
-        disk.write_cnt = 0;
-        disk.seek_cnt = 0;
+        sched_unplug(disk);
+        ret = discard_range(disk, 0, disk->layout_size);
+        if (ret < 0) {
+            user_alert(disk, "reset error: %s", strerror(-ret));
+            return ret;
+        }
+        pthread_mutex_lock(&disk->wlock);
+        if (disk->wcache_map != NULL)
+            memset(disk->wcache_map, 0, 
+                   (disk->layout_size / disk->iounit_size + 63) / 64 * sizeof(uint64_t));
+        disk->wcache_dirty = 0;
+        pthread_mutex_unlock(&disk->wlock);
+        MOVE_HEAD(disk, 0);
+        __atomic_store_n(&disk->pos, 0, __ATOMIC_RELAXED);
+        new_epoch(disk);
+        __atomic_store_n(&disk->service_us, 0, __ATOMIC_RELAXED);
+        break;
+    case IOC_REQ_DEVICE_STATE_V2:                     /* Extended Device State */
+        stat_merge(disk, &stat);
+        memcpy(arg, &stat, sizeof(struct ddriver_state_v2));
+        break;
+    case IOC_REQ_DEVICE_STATE_RESET:                  /* New statistics epoch */
+        new_epoch(disk);
+        break;
+    case IOC_REQ_DEVICE_DISCARD:                      /* Discard a block range */
+        memcpy(&discard, arg, sizeof(struct ddriver_discard));
+        if (!IS_ADDR_ALIGN(disk, discard.offset) || !IS_ADDR_ALIGN(disk, discard.len)) {
+            user_alert(disk, "discard range must be aligned to block size %d", 
+                       disk->iounit_size);
+            return -EINVAL;
+        }
+        if (discard.offset < 0 || discard.len < 0 || 
+            discard.offset + discard.len > disk->layout_size) {
+            user_alert(disk, "discard range [%lld, +%lld) out of disk", 
+                       discard.offset, discard.len);
+            return -EINVAL;
+        }
+        if (discard.len == 0)
+            break;
+        trace_rec(disk, DDRIVER_TRACE_DISCARD, 0, discard.offset, discard.len / disk->iounit_size);
+        sched_unplug(disk);
+        ret = discard_range(disk, discard.offset, discard.len);
+        if (ret < 0) {
+            user_alert(disk, "discard error: %s", strerror(-ret));
+            return ret;
+        }
+        pthread_mutex_lock(&disk->wlock);             /* Nothing left to destage there */
+        wcache_clean(disk, discard.offset, discard.len);
+        pthread_mutex_unlock(&disk->wlock);
+        break;
+    case IOC_REQ_DEVICE_DROP_CACHE:                   /* Evict the image from host cache */
+        sched_unplug(disk);
+        if (disk->backend->drop_cache != NULL)
+            return disk->backend->drop_cache(disk);
+        break;
+    case IOC_REQ_DEVICE_SCHED:                        /* Select the request scheduler */
+        memcpy(&size, arg, sizeof(int));
+        if (size < DDRIVER_SCHED_NOOP || size > DDRIVER_SCHED_DEADLINE)
+            return -EINVAL;
+        __atomic_store_n(&disk->sched, size, __ATOMIC_RELAXED);
+        if (size == DDRIVER_SCHED_NOOP)
+            sched_unplug(disk);
+        break;
+    case IOC_REQ_DEVICE_SCHED_STAT:                   /* Request queue statistics */
+        words = (unsigned long long *)arg;
+        for (i = 0; i < sizeof(struct ddriver_sched_stat) / sizeof(unsigned long long); i++)
+            words[i] = __atomic_load_n((unsigned long long *)&disk->sched_stat + i, __ATOMIC_RELAXED);
+        break;
+    case IOC_REQ_DEVICE_FLUSH:                        /* Destage the write cache */
+        return ddriver_flush(fd);
+    case IOC_REQ_DEVICE_CACHE_STAT:                   /* Write cache statistics */
+        words = (unsigned long long *)&cache;
+        for (i = 0; i < sizeof(struct ddriver_cache_stat) / sizeof(unsigned long long); i++)
+            words[i] = __atomic_load_n((unsigned long long *)&disk->cache_stat + i, __ATOMIC_RELAXED);
+        cache.size  = disk->wcache_blks * disk->iounit_size;
+        cache.dirty = __atomic_load_n(&disk->wcache_dirty, __ATOMIC_RELAXED) * disk->iounit_size;
+        memcpy(arg, &cache, sizeof(struct ddriver_cache_stat));
+        break;
+    case IOC_REQ_DEVICE_TRACE_TAG:                    /* Tag this thread's trace records */
+        memcpy(&trace_tag, arg, sizeof(uint64_t));
+        break;
+    case IOC_REQ_DEVICE_BATCH:                        /* Each entry as its own pread/pwrite */
+        memcpy(&batch, arg, sizeof(struct ddriver_batch));
+        if (batch.nr < 0)
+            return -EINVAL;
+        batch.done = 0;
+        for (i = 0; i < batch.nr; i++) {
+            ent = (struct ddriver_batch_ent *)(uintptr_t)batch.ents + i;
+            if (ent->op == DDRIVER_OP_READ)
+                ent->res = ddriver_pread(fd, (char *)(uintptr_t)ent->buf, ent->nblocks, ent->offset);
+            else if ((ent->op & ~DDRIVER_OP_FUA) == DDRIVER_OP_WRITE)
+                ent->res = pwrite_op(fd, ent->op, (char *)(uintptr_t)ent->buf, ent->nblocks, ent->offset);
+            else
+                ent->res = -EINVAL;
+            if (ent->res >= 0)
+                batch.done++;
+        }
+        memcpy(arg, &batch, sizeof(struct ddriver_batch));
         break;
     case IOC_REQ_DEVICE_IO_SZ:
-        memcpy(arg, &disk.iounit_size, sizeof(int));
+        memcpy(arg, &disk->iounit_size, sizeof(int));
         break;
     default:
         break;
@@ -3,11 +3,24 @@
 
 #include "ddriver_ctl_user.h"
 #include "stdio.h"
+#include <sys/uio.h>
 
 int ddriver_open(char *path);
+int ddriver_open_opts(char *path, struct ddriver_options *opts);
 int ddriver_seek(int fd, off_t offset, int whence);
 int ddriver_write(int fd, char *buf, size_t size);
 int ddriver_read(int fd, char *buf, size_t size);
+int ddriver_writev(int fd, const struct iovec *iov, int iovcnt);
+int ddriver_readv(int fd, const struct iovec *iov, int iovcnt);
+int ddriver_pwrite(int fd, char *buf, int nblocks, off_t offset);
+int ddriver_pwrite_fua(int fd, char *buf, int nblocks, off_t offset);
+int ddriver_pread(int fd, char *buf, int nblocks, off_t offset);
+int ddriver_submit(int fd, struct ddriver_req *reqs, int nr);
+int ddriver_reap(int fd, struct ddriver_cqe *cqes, int nr, int min_complete);
+int ddriver_mmap(int fd);
+char *ddriver_map_read(int fd, int nblocks, off_t offset);
+char *ddriver_map_write(int fd, int nblocks, off_t offset);
+int ddriver_flush(int fd);
 int ddriver_ioctl(int fd, unsigned long cmd, void *ret);
 int ddriver_close(int fd);
 
@@ -0,0 +1,323 @@
+/**
+ * @file ddriver_replay.c
+ * @brief 重放ddriver记录的块IO trace（DDRIVER_TRACE=<file>时生成），
+ *        可换用其他profile、调度策略与写缓存，比较同一负载下的设备时间
+ *
+ *   make replay && ./ddriver_replay [-p profile] [-b backend] [-f image] [-d] [-v] [-q sched]
+ *                                   [-w wcache] [-s speedup] [-x scale] [-l] trace
+ *
+ * -s按trace时间戳的speedup倍速发出请求（墙上时钟），0为不等待，尽快重放；
+ * -v使用虚拟时钟，此时一般用-s 0重放。-b选择存储后端（file/direct/mmap/ram/kernel）。
+ * 目标设备默认按trace头中的设备大小与IO单位打开；给出-x时改为默认或环境变量的大小，
+ * 偏移按比例缩放，超出设备的部分回绕（kernel后端的大小总以内核模块为准）。
+ * 数据内容不在trace中，写入的是填充数据；只重放会改变设备状态的ioctl，
+ * 调度策略由-q决定而不是trace中的IOC_REQ_DEVICE_SCHED。-l只列出记录
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "ddriver.h"
+#include "ddriver_ctl_user.h"
+
+#define REPLAY_BATCH    64
+
+struct replay
+{
+    int       fd;
+    int       io_sz;
+    long long size;
+    double    scale;
+    uint32_t  trace_io_sz;
+    char      *buf[REPLAY_BATCH];                     /* One per batch slot, in flight together */
+    size_t    buf_sz[REPLAY_BATCH];
+    struct ddriver_req batch[REPLAY_BATCH];
+    int       batch_cnt;
+    uint64_t  cnt[DDRIVER_TRACE_DISCARD + 1];
+    uint64_t  skipped;
+    uint64_t  errors;
+};
+
+static const char *op_names[] = {"seek", "read", "write", "flush", "ioctl", "discard"};
+
+static uint64_t wall_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int sched_of(const char *name) {
+    if (strcmp(name, "clook") == 0)
+        return DDRIVER_SCHED_CLOOK;
+    if (strcmp(name, "deadline") == 0)
+        return DDRIVER_SCHED_DEADLINE;
+    return atoi(name);
+}
+
+/* Scale a recorded range onto this device: align to its I/O unit, wrap past the end */
+static off_t map_range(struct replay *rp, const struct ddriver_trace_rec *rec, int *nblocks) {
+    long long len = (long long)rec->nblocks * rp->trace_io_sz;
+    long long ofs = (long long)(rec->offset * rp->scale);
+
+    len = (len + rp->io_sz - 1) / rp->io_sz * rp->io_sz;
+    if (len > rp->size)
+        len = rp->size;
+    ofs = ofs / rp->io_sz * rp->io_sz;
+    if (ofs + len > rp->size)
+        ofs %= rp->size;
+    if (ofs + len > rp->size)
+        ofs = rp->size - len;
+    *nblocks = len / rp->io_sz;
+    return ofs;
+}
+
+/* Async records of one submit are replayed as one batch, then reaped together */
+static void replay_batch(struct replay *rp) {
+    struct ddriver_cqe cqes[REPLAY_BATCH];
+    int done = 0, reaped = 0;
+    int ret, i;
+
+    while (done < rp->batch_cnt) {
+        ret = ddriver_submit(rp->fd, rp->batch + done, rp->batch_cnt - done);
+        if (ret <= 0) {                              /* Queue full, make room */
+            ret = ddriver_reap(rp->fd, cqes, REPLAY_BATCH, 1);
+            for (i = 0; i < ret; i++)
+                rp->errors += cqes[i].res < 0;
+            reaped += ret;
+            if (ret <= 0)
+                break;
+            continue;
+        }
+        done += ret;
+    }
+    rp->errors += rp->batch_cnt - done;
+    while (reaped < done) {
+        ret = ddriver_reap(rp->fd, cqes, REPLAY_BATCH, done - reaped);
+        if (ret <= 0)
+            break;
+        for (i = 0; i < ret; i++)
+            rp->errors += cqes[i].res < 0;
+        reaped += ret;
+    }
+    rp->batch_cnt = 0;
+}
+
+/* Buffer of batch slot i; synchronous requests use slot 0 as the batch is empty then */
+static char *replay_buf(struct replay *rp, int i, int nblocks) {
+    size_t need = (size_t)nblocks * rp->io_sz;
+
+    if (need > rp->buf_sz[i]) {
+        free(rp->buf[i]);
+        rp->buf[i] = malloc(need);
+        rp->buf_sz[i] = rp->buf[i] != NULL ? need : 0;
+        if (rp->buf[i] != NULL)
+            memset(rp->buf[i], 0x5a, need);
+    }
+    return rp->buf[i];
+}
+
+static void replay_rec(struct replay *rp, const struct ddriver_trace_rec *rec) {
+    struct ddriver_discard discard;
+    struct ddriver_req *req;
+    unsigned long cmd;
+    int nblocks, ret = 0;
+    off_t ofs;
+    char *buf;
+
+    if (rp->batch_cnt > 0 &&
+        (!(rec->flags & DDRIVER_TRACE_ASYNC) || rp->batch_cnt == REPLAY_BATCH))
+        replay_batch(rp);
+    if (rec->op > DDRIVER_TRACE_DISCARD) {
+        rp->skipped++;
+        return;
+    }
+
+    switch (rec->op)
+    {
+    case DDRIVER_TRACE_SEEK:
+        ofs = map_range(rp, rec, &nblocks);
+        ret = ddriver_seek(rp->fd, ofs, SEEK_SET);
+        break;
+    case DDRIVER_TRACE_READ:
+    case DDRIVER_TRACE_WRITE:                        /* Head and mapped I/O become positional */
+        ofs = map_range(rp, rec, &nblocks);
+        buf = replay_buf(rp, rp->batch_cnt, nblocks);
+        if (buf == NULL || nblocks == 0) {
+            ret = -1;
+            break;
+        }
+        if (rec->flags & DDRIVER_TRACE_ASYNC) {
+            req = &rp->batch[rp->batch_cnt++];
+            req->op      = rec->op == DDRIVER_TRACE_WRITE ? DDRIVER_OP_WRITE : DDRIVER_OP_READ;
+            req->op     |= rec->flags & DDRIVER_TRACE_FUA ? DDRIVER_OP_FUA : 0;
+            req->offset  = ofs;
+            req->nblocks = nblocks;
+            req->buf     = buf;
+            req->tag     = rec->tag;
+        }
+        else if (rec->op == DDRIVER_TRACE_READ)
+            ret = ddriver_pread(rp->fd, buf, nblocks, ofs);
+        else if (rec->flags & DDRIVER_TRACE_FUA)
+            ret = ddriver_pwrite_fua(rp->fd, buf, nblocks, ofs);
+        else
+            ret = ddriver_pwrite(rp->fd, buf, nblocks, ofs);
+        break;
+    case DDRIVER_TRACE_FLUSH:
+        ret = ddriver_flush(rp->fd);
+        break;
+    case DDRIVER_TRACE_DISCARD:
+        discard.offset = map_range(rp, rec, &nblocks);
+        discard.len    = (long long)nblocks * rp->io_sz;
+        ret = ddriver_ioctl(rp->fd, IOC_REQ_DEVICE_DISCARD, &discard);
+        break;
+    case DDRIVER_TRACE_IOCTL:                        /* Queries and SCHED are not replayed */
+        cmd = rec->offset;
+        if (cmd != IOC_REQ_DEVICE_RESET && cmd != IOC_REQ_DEVICE_STATE_RESET &&
+            cmd != IOC_REQ_DEVICE_DROP_CACHE) {
+            rp->skipped++;
+            return;
+        }
+        ret = ddriver_ioctl(rp->fd, cmd, NULL);
+        break;
+    }
+    rp->cnt[rec->op]++;
+    if (ret < 0)
+        rp->errors++;
+}
+
+static void print_rec(const struct ddriver_trace_rec *rec) {
+    printf(rec->op == DDRIVER_TRACE_IOCTL ? "%12llu %-7s %c%c%c%c %#12llx %8u tag %llu\n" :
+                                            "%12llu %-7s %c%c%c%c %12lld %8u tag %llu\n",
+           (unsigned long long)rec->ts_us,
+           rec->op <= DDRIVER_TRACE_DISCARD ? op_names[rec->op] : "?",
+           rec->flags & DDRIVER_TRACE_FUA   ? 'F' : '-',
+           rec->flags & DDRIVER_TRACE_ASYNC ? 'A' : '-',
+           rec->flags & DDRIVER_TRACE_HEAD  ? 'H' : '-',
+           rec->flags & DDRIVER_TRACE_MAP   ? 'M' : '-',
+           (long long)rec->offset, rec->nblocks, (unsigned long long)rec->tag);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-p profile] [-b file|direct|mmap|ram|kernel] [-f image] [-d] [-v] "
+                    "[-q noop|clook|deadline] [-w wcache] [-s speedup] [-x scale] [-l] trace\n", prog);
+}
+
+int main(int argc, char **argv) {
+    struct ddriver_options opts;
+    struct ddriver_trace_hdr hdr;
+    struct ddriver_trace_rec rec;
+    struct ddriver_state_v2 st;
+    struct ddriver_sim_time sim;
+    struct replay rp;
+    const char *image = "/tmp/ddriver_replay";
+    char *raw;
+    double speedup = 1;
+    uint64_t start, due, now, total = 0;
+    int list = 0, scaled = 0;
+    int c, i;
+    FILE *in;
+
+    memset(&opts, 0, sizeof(opts));
+    memset(&rp, 0, sizeof(rp));
+    rp.scale = 1;
+    while ((c = getopt(argc, argv, "p:b:f:dvq:w:s:x:l")) != -1) {
+        switch (c)
+        {
+        case 'p': opts.profile = optarg; break;
+        case 'b': opts.backend = optarg; break;
+        case 'f': image = optarg; break;
+        case 'd': opts.direct = 1; break;
+        case 'v': opts.vclock = 1; break;
+        case 'q': opts.sched = sched_of(optarg); opts.sched_set = 1; break;
+        case 'w': opts.wcache = atoll(optarg); break;
+        case 's': speedup = atof(optarg); break;
+        case 'x': rp.scale = atof(optarg); scaled = 1; break;
+        case 'l': list = 1; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || speedup < 0 || rp.scale <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    in = fopen(argv[optind], "rb");
+    if (in == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1 || hdr.magic != DDRIVER_TRACE_MAGIC ||
+        hdr.version != DDRIVER_TRACE_VERSION || hdr.rec_size < sizeof(rec)) {
+        fprintf(stderr, "%s: not a ddriver trace\n", argv[optind]);
+        fclose(in);
+        return 1;
+    }
+    raw = malloc(hdr.rec_size);                      /* Newer records may be longer */
+    hdr.profile[DDRIVER_NAME_LEN - 1] = '\0';
+    printf("trace: profile %s, disk %lld, io unit %u\n", hdr.profile,
+           (long long)hdr.disk_size, hdr.iounit_size);
+    if (list) {
+        while (fread(raw, hdr.rec_size, 1, in) == 1) {
+            memcpy(&rec, raw, sizeof(rec));
+            print_rec(&rec);
+        }
+        free(raw);
+        fclose(in);
+        return 0;
+    }
+
+    if (getenv("DDRIVER_TRACE") != NULL)             /* Don't trace the replay over the input */
+        unsetenv("DDRIVER_TRACE");
+    if (!scaled) {                                   /* Same device as recorded */
+        opts.geo.disk_size   = hdr.disk_size;
+        opts.geo.iounit_size = hdr.iounit_size;
+    }
+    rp.fd = ddriver_open_opts((char *)image, &opts);
+    if (rp.fd < 0) {
+        fprintf(stderr, "can't open %s: %d\n", image, rp.fd);
+        free(raw);
+        fclose(in);
+        return 1;
+    }
+    ddriver_ioctl(rp.fd, IOC_REQ_DEVICE_SIZE64, &rp.size);
+    ddriver_ioctl(rp.fd, IOC_REQ_DEVICE_IO_SZ, &rp.io_sz);
+    rp.trace_io_sz = hdr.iounit_size;
+
+    start = wall_us();
+    while (fread(raw, hdr.rec_size, 1, in) == 1) {
+        memcpy(&rec, raw, sizeof(rec));
+        if (speedup > 0) {                           /* Pace by the recorded timestamps */
+            due = start + (uint64_t)(rec.ts_us / speedup);
+            now = wall_us();
+            if (due > now)
+                usleep(due - now);
+        }
+        replay_rec(&rp, &rec);
+        total++;
+    }
+    if (rp.batch_cnt > 0)
+        replay_batch(&rp);
+    ddriver_flush(rp.fd);                            /* Charge what the cache still holds */
+    now = wall_us();
+
+    ddriver_ioctl(rp.fd, IOC_REQ_DEVICE_STATE_V2, &st);
+    ddriver_ioctl(rp.fd, IOC_REQ_DEVICE_SIM_TIME, &sim);
+    printf("replayed %llu records in %.3f s, %llu skipped, %llu errors\n",
+           (unsigned long long)total, (now - start) / 1e6,
+           (unsigned long long)rp.skipped, (unsigned long long)rp.errors);
+    for (i = 0; i <= DDRIVER_TRACE_DISCARD; i++)
+        printf("  %-7s %llu\n", op_names[i], (unsigned long long)rp.cnt[i]);
+    printf("device: service %llu us, clock %llu us\n", sim.service_us, sim.clock_us);
+    printf("  reads %llu (%llu B), writes %llu (%llu B), seeks %llu\n",
+           st.read.cnt, st.read.bytes, st.write.cnt, st.write.bytes, st.seek_cnt);
+    ddriver_close(rp.fd);
+
+    for (i = 0; i < REPLAY_BATCH; i++)
+        free(rp.buf[i]);
+    free(raw);
+    fclose(in);
+    return rp.errors != 0;
+}
@@ -2,20 +2,221 @@
 #define _DDRIVER_CTL_H_
 
 #include <sys/ioctl.h>   
+#include <sys/types.h>
+#include <stdint.h>
 /******************************************************************************
 * SECTION: IO ctl protocol definitions
 *******************************************************************************/
 #define IOC_MAGIC               'A'
+#define DDRIVER_NAME_LEN        32
+struct ddriver_geometry
+{
+    long long disk_size;
+    int       iounit_size;
+    int       read_lat;
+    int       write_lat;
+    int       seek_lat;
+    int       xfer_bw;
+    int       track_num;
+    int       queue_depth;
+    char      profile[DDRIVER_NAME_LEN];
+};
+
+struct ddriver_sim_time
+{
+    unsigned long long service_us;
+    unsigned long long clock_us;
+};
+
 struct ddriver_state
 {
     int write_cnt;
     int read_cnt;
-    int seek_cnt;
+    int seek_cnt;                                                           /* 同ddriver_state_v2.seek_cnt */
+};
+
+#define DDRIVER_HIST_BUCKETS    32
+
+struct ddriver_op_stat
+{
+    unsigned long long cnt;
+    unsigned long long blks;
+    unsigned long long bytes;
+    unsigned long long seq_cnt;
+    unsigned long long rand_cnt;
+    unsigned long long lat_us;
+    unsigned long long lat_hist[DDRIVER_HIST_BUCKETS];
+};
+
+struct ddriver_state_v2
+{
+    unsigned long long epoch;
+    unsigned long long epoch_us;
+    unsigned long long seek_cnt;                                            /* IO引起的磁头移动次数，seek/llseek不计 */
+    unsigned long long seek_dist_hist[DDRIVER_HIST_BUCKETS];
+    struct ddriver_op_stat read;
+    struct ddriver_op_stat write;
+};
+
+struct ddriver_discard
+{
+    long long offset;
+    long long len;
+};
+
+#define DDRIVER_SCHED_NOOP      0
+#define DDRIVER_SCHED_CLOOK     1
+#define DDRIVER_SCHED_DEADLINE  2
+
+struct ddriver_sched_stat
+{
+    unsigned long long dispatched;
+    unsigned long long merged;
+    unsigned long long expired;
+    unsigned long long seek_fifo;
+    unsigned long long seek_sched;
+};
+
+struct ddriver_cache_stat
+{
+    unsigned long long size;
+    unsigned long long dirty;
+    unsigned long long cached_writes;
+    unsigned long long fua_writes;
+    unsigned long long flushes;
+    unsigned long long destages;
+    unsigned long long destaged_bytes;
+    unsigned long long destage_us;
+};
+
+struct ddriver_batch_ent
+{
+    int                op;
+    int                nblocks;
+    long long          offset;
+    unsigned long long buf;
+    long long          res;
+};
+
+struct ddriver_batch
+{
+    unsigned long long ents;
+    int                nr;
+    int                done;
 };
 
 #define IOC_REQ_DEVICE_SIZE     _IOR(IOC_MAGIC, 0, int)
 #define IOC_REQ_DEVICE_STATE    _IOR(IOC_MAGIC, 1, struct ddriver_state)
 #define IOC_REQ_DEVICE_RESET    _IO(IOC_MAGIC, 2)
 #define IOC_REQ_DEVICE_IO_SZ    _IOR(IOC_MAGIC, 3, int)
+#define IOC_REQ_DEVICE_SIZE64   _IOR(IOC_MAGIC, 4, long long)
+#define IOC_REQ_DEVICE_GEOMETRY _IOR(IOC_MAGIC, 5, struct ddriver_geometry)
+#define IOC_REQ_DEVICE_SIM_TIME _IOR(IOC_MAGIC, 6, struct ddriver_sim_time)
+#define IOC_REQ_DEVICE_STATE_V2 _IOR(IOC_MAGIC, 7, struct ddriver_state_v2)
+#define IOC_REQ_DEVICE_STATE_RESET _IO(IOC_MAGIC, 8)
+#define IOC_REQ_DEVICE_DISCARD  _IOW(IOC_MAGIC, 9, struct ddriver_discard)
+#define IOC_REQ_DEVICE_DROP_CACHE _IO(IOC_MAGIC, 10)
+#define IOC_REQ_DEVICE_SCHED    _IOW(IOC_MAGIC, 11, int)
+#define IOC_REQ_DEVICE_SCHED_STAT _IOR(IOC_MAGIC, 12, struct ddriver_sched_stat)
+#define IOC_REQ_DEVICE_FLUSH    _IO(IOC_MAGIC, 13)
+#define IOC_REQ_DEVICE_CACHE_STAT _IOR(IOC_MAGIC, 14, struct ddriver_cache_stat)
+#define IOC_REQ_DEVICE_TRACE_TAG _IOW(IOC_MAGIC, 15, unsigned long long)
+#define IOC_REQ_DEVICE_BATCH    _IOWR(IOC_MAGIC, 16, struct ddriver_batch)
+
+/******************************************************************************
+* SECTION: Async IO protocol definitions
+*******************************************************************************/
+#define DDRIVER_OP_READ         0
+#define DDRIVER_OP_WRITE        1
+#define DDRIVER_OP_FUA          0x100
+
+struct ddriver_req
+{
+    int      op;
+    char     *buf;
+    int      nblocks;
+    off_t    offset;
+    uint64_t tag;
+};
+
+struct ddriver_cqe
+{
+    uint64_t tag;
+    int      res;
+};
+
+/******************************************************************************
+* SECTION: Open options
+*******************************************************************************/
+struct ddriver_options
+{
+    struct ddriver_geometry geo;
+    const char *profile;
+    const char *profile_file;
+    int vclock;
+    int direct;
+    int sched;
+    int sched_set;
+    long long wcache;
+    const char *trace;
+    const char *backend;
+};
+
+/******************************************************************************
+* SECTION: Log protocol definitions
+*******************************************************************************/
+#define DDRIVER_LOG_DEBUG       0
+#define DDRIVER_LOG_INFO        1
+#define DDRIVER_LOG_WARN        2
+#define DDRIVER_LOG_PANIC       3
+
+#define DDRIVER_LOG_MAGIC       0x474f4c44
+
+struct ddriver_log_rec
+{
+    uint64_t ts_us;
+    uint16_t level;
+    uint16_t len;
+    uint32_t seq;
+};
+
+/******************************************************************************
+* SECTION: Trace protocol definitions
+*******************************************************************************/
+#define DDRIVER_TRACE_MAGIC     0x43525444
+#define DDRIVER_TRACE_VERSION   1
+
+#define DDRIVER_TRACE_SEEK      0
+#define DDRIVER_TRACE_READ      1
+#define DDRIVER_TRACE_WRITE     2
+#define DDRIVER_TRACE_FLUSH     3
+#define DDRIVER_TRACE_IOCTL     4
+#define DDRIVER_TRACE_DISCARD   5
+
+#define DDRIVER_TRACE_FUA       0x1
+#define DDRIVER_TRACE_ASYNC     0x2
+#define DDRIVER_TRACE_HEAD      0x4
+#define DDRIVER_TRACE_MAP       0x8
+
+struct ddriver_trace_hdr
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t rec_size;
+    uint32_t iounit_size;
+    uint32_t reserved;
+    int64_t  disk_size;
+    char     profile[DDRIVER_NAME_LEN];
+};
+
+struct ddriver_trace_rec
+{
+    uint64_t ts_us;
+    int64_t  offset;
+    uint64_t tag;
+    uint32_t nblocks;
+    uint16_t op;
+    uint16_t flags;
+};
 
 #endif
\ No newline at end of file
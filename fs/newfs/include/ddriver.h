@@ -3,17 +3,29 @@
 
 #include "ddriver_ctl_user.h"
 #include "stdio.h"
+#include <sys/uio.h>
 
 /**
- * @brief 打开ddriver设备
+ * @brief 打开ddriver设备。每次打开得到独立的设备实例，同一进程可同时打开多个镜像。
+ *        除ddriver_close外，各接口可被多个线程并发调用
  * 
- * @param path ddriver设备路径
- * @return int 0成功，否则失败
+ * @param path ddriver设备路径（磁盘镜像文件），不存在时创建
+ * @return int ddriver设备handler，负数表示失败
  */
 int ddriver_open(char *path);
 
 /**
- * @brief 移动ddriver磁盘头
+ * @brief 按指定参数打开ddriver设备，可配置设备大小、IO单位、延迟模型与存储后端。
+ *        未指定（为0）的参数取DDRIVER_DISK_SZ、DDRIVER_IO_SZ等环境变量，再取默认值
+ * 
+ * @param path ddriver设备路径
+ * @param opts 打开参数，可为NULL
+ * @return int ddriver设备handler，失败返回负的errno
+ */
+int ddriver_open_opts(char *path, struct ddriver_options *opts);
+
+/**
+ * @brief 设置ddriver_read/write的读写位置。磁头在IO时才移动，SEEK也在那时计数
  * 
  * @param fd ddriver设备handler
  * @param offset 移动到的位置，注意要和设备IO单位对齐
@@ -42,6 +54,120 @@ int ddriver_write(int fd, char *buf, size_t size);
  */
 int ddriver_read(int fd, char *buf, size_t size);
 
+/**
+ * @brief 批量写入多个连续块，整个请求只计一次延迟
+ * 
+ * @param fd ddriver设备handler
+ * @param iov 要写入的数据段，每段大小须为设备IO单位的整数倍
+ * @param iovcnt 数据段个数
+ * @return int 写入的字节数，小于0为失败
+ */
+int ddriver_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief 批量读出多个连续块，整个请求只计一次延迟
+ * 
+ * @param fd ddriver设备handler
+ * @param iov 要读出的数据段，每段大小须为设备IO单位的整数倍
+ * @param iovcnt 数据段个数
+ * @return int 读出的字节数，小于0为失败
+ */
+int ddriver_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief 定位写入，无需先调用ddriver_seek，可多线程并发调用
+ * 
+ * @param fd ddriver设备handler
+ * @param buf 要写入的数据Buf
+ * @param nblocks 要写入的块数（以设备IO单位计）
+ * @param offset 写入位置，注意要和设备IO单位对齐
+ * @return int 写入的字节数，小于0为失败
+ */
+int ddriver_pwrite(int fd, char *buf, int nblocks, off_t offset);
+
+/**
+ * @brief FUA定位写入，绕过设备写缓存，返回时数据已在介质上
+ * 
+ * @param fd ddriver设备handler
+ * @param buf 要写入的数据Buf
+ * @param nblocks 要写入的块数（以设备IO单位计）
+ * @param offset 写入位置，注意要和设备IO单位对齐
+ * @return int 写入的字节数，小于0为失败
+ */
+int ddriver_pwrite_fua(int fd, char *buf, int nblocks, off_t offset);
+
+/**
+ * @brief 定位读出，无需先调用ddriver_seek，可多线程并发调用
+ * 
+ * @param fd ddriver设备handler
+ * @param buf 要读出的数据Buf
+ * @param nblocks 要读出的块数（以设备IO单位计）
+ * @param offset 读出位置，注意要和设备IO单位对齐
+ * @return int 读出的字节数，小于0为失败
+ */
+int ddriver_pread(int fd, char *buf, int nblocks, off_t offset);
+
+/**
+ * @brief 异步提交一批请求，不等待设备延迟，完成后用ddriver_reap收割。
+ *        数据经io_uring搬运（不可用时在提交时同步搬运）；选择了调度策略
+ *        （见IOC_REQ_DEVICE_SCHED）时请求先排队，出队时才读写buf。
+ *        buf须保持有效直到收割
+ * 
+ * @param fd ddriver设备handler
+ * @param reqs 请求数组，见ddriver_ctl_user中的ddriver_req
+ * @param nr 请求个数
+ * @return int 成功提交的请求数，队列满时可能小于nr
+ */
+int ddriver_submit(int fd, struct ddriver_req *reqs, int nr);
+
+/**
+ * @brief 收割已完成的异步请求，按完成先后返回
+ * 
+ * @param fd ddriver设备handler
+ * @param cqes 返回的完成项
+ * @param nr 最多返回的完成项个数
+ * @param min_complete 至少等待完成的请求数，0为不等待
+ * @return int 返回的完成项个数
+ */
+int ddriver_reap(int fd, struct ddriver_cqe *cqes, int nr, int min_complete);
+
+/**
+ * @brief 将ddriver镜像映射进内存（可选），之后可零拷贝访问磁盘块
+ * 
+ * @param fd ddriver设备handler
+ * @return int 0成功，否则失败
+ */
+int ddriver_mmap(int fd);
+
+/**
+ * @brief 取得映射中从offset开始的nblocks个块用于读，需先调用ddriver_mmap
+ * 
+ * @param fd ddriver设备handler
+ * @param nblocks 块数（以设备IO单位计）
+ * @param offset 位置，注意要和设备IO单位对齐
+ * @return char* 指向映射中对应块的指针，失败返回NULL
+ */
+char *ddriver_map_read(int fd, int nblocks, off_t offset);
+
+/**
+ * @brief 取得映射中从offset开始的nblocks个块用于写，需先调用ddriver_mmap
+ * 
+ * @param fd ddriver设备handler
+ * @param nblocks 块数（以设备IO单位计）
+ * @param offset 位置，注意要和设备IO单位对齐
+ * @return char* 指向映射中对应块的指针，失败返回NULL
+ */
+char *ddriver_map_write(int fd, int nblocks, off_t offset);
+
+/**
+ * @brief 设备FLUSH：将映射中的修改写回ddriver镜像，并回写设备写缓存中的全部数据。
+ *        返回后之前完成的写都已落盘
+ * 
+ * @param fd ddriver设备handler
+ * @return int 0成功，否则失败
+ */
+int ddriver_flush(int fd);
+
 /**
  * @brief ddriver IO控制
  * 
@@ -2,20 +2,221 @@
 #define _DDRIVER_CTL_H_
 
 #include <sys/ioctl.h>   
+#include <sys/types.h>
+#include <stdint.h>
 /******************************************************************************
 * SECTION: IO ctl protocol definitions
 *******************************************************************************/
 #define IOC_MAGIC               'A'
+#define DDRIVER_NAME_LEN        32                                          /* 设备profile名最大长度 */
+struct ddriver_geometry                                                     /* 设备参数，时间单位为us */
+{
+    long long disk_size;                                                    /* 设备大小，单位B */
+    int       iounit_size;                                                  /* 设备IO单位，单位B */
+    int       read_lat;                                                     /* 单次读请求延迟 */
+    int       write_lat;                                                    /* 单次写请求延迟 */
+    int       seek_lat;                                                     /* 磁头转一整圈的延迟 */
+    int       xfer_bw;                                                      /* 传输带宽，单位MB/s */
+    int       track_num;                                                    /* 磁道数 */
+    int       queue_depth;                                                  /* 可并行服务的请求数 */
+    char      profile[DDRIVER_NAME_LEN];                                    /* 设备profile名 */
+};
+
+struct ddriver_sim_time                                                     /* 模拟设备时间，单位us */
+{
+    unsigned long long service_us;                                          /* 延迟模型累计的服务时间 */
+    unsigned long long clock_us;                                            /* 打开以来的设备时钟（虚拟时钟模式下为虚拟时间） */
+};
+
 struct ddriver_state
 {
     int write_cnt;
     int read_cnt;
-    int seek_cnt;
+    int seek_cnt;                                                           /* 同ddriver_state_v2.seek_cnt */
+};
+
+#define DDRIVER_HIST_BUCKETS    32                                          /* 直方图桶数，桶b统计[2^(b-1), 2^b) */
+
+struct ddriver_op_stat                                                      /* 单类操作（读或写）的统计 */
+{
+    unsigned long long cnt;                                                 /* 请求数 */
+    unsigned long long blks;                                                /* 块数（以设备IO单位计） */
+    unsigned long long bytes;                                               /* 字节数 */
+    unsigned long long seq_cnt;                                             /* 顺序请求数：起始位置即磁头位置 */
+    unsigned long long rand_cnt;                                            /* 随机请求数 */
+    unsigned long long lat_us;                                              /* 累计服务时间，单位us */
+    unsigned long long lat_hist[DDRIVER_HIST_BUCKETS];                      /* 服务时间直方图，单位us */
+};
+
+struct ddriver_state_v2                                                     /* 扩展设备状态，计数自上次重置（epoch）起 */
+{
+    unsigned long long epoch;                                               /* 当前epoch编号 */
+    unsigned long long epoch_us;                                            /* epoch开始时的设备时钟，单位us */
+    unsigned long long seek_cnt;                                            /* IO引起的磁头移动次数，seek/llseek不计 */
+    unsigned long long seek_dist_hist[DDRIVER_HIST_BUCKETS];                /* SEEK距离直方图，单位块 */
+    struct ddriver_op_stat read;                                            /* 读统计 */
+    struct ddriver_op_stat write;                                           /* 写统计 */
+};
+
+struct ddriver_discard                                                      /* 丢弃的块范围，须与设备IO单位对齐 */
+{
+    long long offset;                                                       /* 起始偏移，单位B */
+    long long len;                                                          /* 长度，单位B */
+};
+
+#define DDRIVER_SCHED_NOOP      0                                           /* 请求队列调度策略，见IOC_REQ_DEVICE_SCHED，默认不排队 */
+#define DDRIVER_SCHED_CLOOK     1                                           /* 按C-LOOK顺序服务，合并相邻请求 */
+#define DDRIVER_SCHED_DEADLINE  2                                           /* 同C-LOOK，但超时的请求优先服务 */
+
+struct ddriver_sched_stat                                                   /* 请求队列统计，计数自上次重置（epoch）起 */
+{
+    unsigned long long dispatched;                                          /* 出队服务的请求数 */
+    unsigned long long merged;                                              /* 被合并进相邻请求的请求数 */
+    unsigned long long expired;                                             /* 因超时而优先服务的请求数 */
+    unsigned long long seek_fifo;                                           /* 按到达顺序服务时磁头移动的距离，单位B */
+    unsigned long long seek_sched;                                          /* 调度后磁头实际移动的距离，单位B */
+};
+
+struct ddriver_cache_stat                                                   /* 写缓存统计，计数自上次重置（epoch）起 */
+{
+    unsigned long long size;                                                /* 缓存容量，单位B，0表示未开启 */
+    unsigned long long dirty;                                               /* 当前尚未回写的数据，单位B */
+    unsigned long long cached_writes;                                       /* 写入缓存即返回的写请求数 */
+    unsigned long long fua_writes;                                          /* 带DDRIVER_OP_FUA直达介质的写请求数 */
+    unsigned long long flushes;                                             /* FLUSH次数 */
+    unsigned long long destages;                                            /* 缓存写满被迫回写的次数 */
+    unsigned long long destaged_bytes;                                      /* 回写的数据量，单位B */
+    unsigned long long destage_us;                                          /* 回写累计服务时间，单位us */
+};
+
+struct ddriver_batch_ent                                                    /* 批量请求中的一项，见IOC_REQ_DEVICE_BATCH */
+{
+    int                op;                                                  /* DDRIVER_OP_READ / DDRIVER_OP_WRITE */
+    int                nblocks;                                             /* 块数（以设备IO单位计） */
+    long long          offset;                                              /* 位置，须与设备IO单位对齐 */
+    unsigned long long buf;                                                 /* 用户缓冲区地址，(uintptr_t)buf */
+    long long          res;                                                 /* 返回：读写的字节数，或负的errno */
+};
+
+struct ddriver_batch                                                        /* 一批请求，一次ioctl内依次执行 */
+{
+    unsigned long long ents;                                                /* ddriver_batch_ent数组地址，(uintptr_t)ents */
+    int                nr;                                                  /* 请求个数 */
+    int                done;                                                /* 返回：成功的请求数 */
 };
 
 #define IOC_REQ_DEVICE_SIZE     _IOR(IOC_MAGIC, 0, int)                     /* 请求查看设备大小 */
 #define IOC_REQ_DEVICE_STATE    _IOR(IOC_MAGIC, 1, struct ddriver_state)    /* 请求设备状态，返回 ddriver_state */
 #define IOC_REQ_DEVICE_RESET    _IO(IOC_MAGIC, 2)                           /* 请求重置设备 */
 #define IOC_REQ_DEVICE_IO_SZ    _IOR(IOC_MAGIC, 3, int)                     /* 请求设备IO大小 */
+#define IOC_REQ_DEVICE_SIZE64   _IOR(IOC_MAGIC, 4, long long)               /* 请求查看设备大小（64位） */
+#define IOC_REQ_DEVICE_GEOMETRY _IOR(IOC_MAGIC, 5, struct ddriver_geometry) /* 请求设备参数，返回 ddriver_geometry */
+#define IOC_REQ_DEVICE_SIM_TIME _IOR(IOC_MAGIC, 6, struct ddriver_sim_time) /* 请求模拟设备时间，返回 ddriver_sim_time */
+#define IOC_REQ_DEVICE_STATE_V2 _IOR(IOC_MAGIC, 7, struct ddriver_state_v2) /* 请求扩展设备状态，返回 ddriver_state_v2 */
+#define IOC_REQ_DEVICE_STATE_RESET _IO(IOC_MAGIC, 8)                        /* 开始新的统计epoch，不改变数据 */
+#define IOC_REQ_DEVICE_DISCARD  _IOW(IOC_MAGIC, 9, struct ddriver_discard)  /* 丢弃块范围，之后读出为0 */
+#define IOC_REQ_DEVICE_DROP_CACHE _IO(IOC_MAGIC, 10)                        /* 写回并丢弃镜像在宿主机上的页缓存 */
+#define IOC_REQ_DEVICE_SCHED    _IOW(IOC_MAGIC, 11, int)                    /* 切换请求队列调度策略，DDRIVER_SCHED_* */
+#define IOC_REQ_DEVICE_SCHED_STAT _IOR(IOC_MAGIC, 12, struct ddriver_sched_stat) /* 请求队列统计，返回 ddriver_sched_stat */
+#define IOC_REQ_DEVICE_FLUSH    _IO(IOC_MAGIC, 13)                          /* 回写写缓存中的全部脏数据，同ddriver_flush */
+#define IOC_REQ_DEVICE_CACHE_STAT _IOR(IOC_MAGIC, 14, struct ddriver_cache_stat) /* 写缓存统计，返回 ddriver_cache_stat */
+#define IOC_REQ_DEVICE_TRACE_TAG _IOW(IOC_MAGIC, 15, unsigned long long) /* 设置本线程之后请求在trace中的调用者标签 */
+#define IOC_REQ_DEVICE_BATCH    _IOWR(IOC_MAGIC, 16, struct ddriver_batch)  /* 批量读写，一次进入设备执行多个请求，各项结果写回res */
+
+/******************************************************************************
+* SECTION: Async IO protocol definitions
+*******************************************************************************/
+#define DDRIVER_OP_READ         0                                           /* 读请求 */
+#define DDRIVER_OP_WRITE        1                                           /* 写请求 */
+#define DDRIVER_OP_FUA          0x100                                       /* 与写请求按位或：绕过写缓存，完成即落盘 */
+
+struct ddriver_req                                                          /* 异步请求，见ddriver_submit */
+{
+    int      op;                                                            /* DDRIVER_OP_READ / DDRIVER_OP_WRITE */
+    char     *buf;                                                          /* 数据Buf */
+    int      nblocks;                                                       /* 块数（以设备IO单位计） */
+    off_t    offset;                                                        /* 位置，须与设备IO单位对齐 */
+    uint64_t tag;                                                           /* 用户标签，完成时原样返回 */
+};
+
+struct ddriver_cqe                                                          /* 完成项，见ddriver_reap */
+{
+    uint64_t tag;                                                           /* 请求的用户标签 */
+    int      res;                                                           /* 传输字节数，小于0为失败 */
+};
+
+/******************************************************************************
+* SECTION: Open options
+*******************************************************************************/
+struct ddriver_options                                                      /* 打开参数，见ddriver_open_opts，0表示取默认值 */
+{
+    struct ddriver_geometry geo;                                            /* 其中profile字段被忽略 */
+    const char *profile;                                                    /* 设备profile: hdd, hdd7200, sata-ssd, nvme, ram */
+    const char *profile_file;                                               /* 从文件加载profile，优先于profile */
+    int vclock;                                                             /* 非0时使用虚拟时钟，不真实睡眠 */
+    int direct;                                                             /* 非0时以O_DIRECT打开镜像，绕过宿主机页缓存 */
+    int sched;                                                              /* 异步请求队列调度策略，DDRIVER_SCHED_*，sched_set非0时生效 */
+    int sched_set;                                                          /* 非0时使用sched，可借此选择DDRIVER_SCHED_NOOP */
+    long long wcache;                                                       /* 设备写缓存大小，单位B，0为不开启 */
+    const char *trace;                                                      /* 记录块IO trace的文件路径，NULL为不记录 */
+    const char *backend;                                                    /* 存储后端: file, direct, mmap, ram, kernel，NULL按路径推断 */
+};
+
+/******************************************************************************
+* SECTION: Log protocol definitions
+*******************************************************************************/
+#define DDRIVER_LOG_DEBUG       0                                           /* 日志级别，由DDRIVER_LOG_LEVEL选择 */
+#define DDRIVER_LOG_INFO        1
+#define DDRIVER_LOG_WARN        2
+#define DDRIVER_LOG_PANIC       3
+
+#define DDRIVER_LOG_MAGIC       0x474f4c44                                  /* 二进制日志文件头，"DLOG" */
+
+struct ddriver_log_rec                                                      /* 二进制日志记录头，DDRIVER_LOG_FORMAT=bin时使用 */
+{
+    uint64_t ts_us;                                                         /* 时间戳，单位us（CLOCK_MONOTONIC） */
+    uint16_t level;                                                         /* 日志级别 */
+    uint16_t len;                                                           /* 紧随其后的消息长度，不含结尾0 */
+    uint32_t seq;                                                           /* 记录序号，从0递增 */
+};
+
+/******************************************************************************
+* SECTION: Trace protocol definitions
+*******************************************************************************/
+#define DDRIVER_TRACE_MAGIC     0x43525444                                  /* trace文件头，"DTRC" */
+#define DDRIVER_TRACE_VERSION   1
+
+#define DDRIVER_TRACE_SEEK      0                                           /* trace记录类型 */
+#define DDRIVER_TRACE_READ      1
+#define DDRIVER_TRACE_WRITE     2
+#define DDRIVER_TRACE_FLUSH     3
+#define DDRIVER_TRACE_IOCTL     4                                           /* offset字段为ioctl命令号 */
+#define DDRIVER_TRACE_DISCARD   5
+
+#define DDRIVER_TRACE_FUA       0x1                                         /* FUA写 */
+#define DDRIVER_TRACE_ASYNC     0x2                                         /* 经ddriver_submit提交 */
+#define DDRIVER_TRACE_HEAD      0x4                                         /* 经ddriver_read/ddriver_write等基于磁头位置的接口 */
+#define DDRIVER_TRACE_MAP       0x8                                         /* 经ddriver_map_read/ddriver_map_write */
+
+struct ddriver_trace_hdr                                                    /* trace文件头，其后紧跟定长的ddriver_trace_rec */
+{
+    uint32_t magic;                                                         /* DDRIVER_TRACE_MAGIC */
+    uint16_t version;                                                       /* DDRIVER_TRACE_VERSION */
+    uint16_t rec_size;                                                      /* 单条记录的大小 */
+    uint32_t iounit_size;                                                   /* 记录时的设备IO单位 */
+    uint32_t reserved;
+    int64_t  disk_size;                                                     /* 记录时的设备大小 */
+    char     profile[DDRIVER_NAME_LEN];                                     /* 记录时的设备profile */
+};
+
+struct ddriver_trace_rec                                                    /* trace记录 */
+{
+    uint64_t ts_us;                                                         /* 打开设备以来的设备时钟，单位us */
+    int64_t  offset;                                                        /* 位置，单位B */
+    uint64_t tag;                                                           /* 调用者标签，见IOC_REQ_DEVICE_TRACE_TAG */
+    uint32_t nblocks;                                                       /* 块数（以设备IO单位计） */
+    uint16_t op;                                                            /* DDRIVER_TRACE_SEEK等 */
+    uint16_t flags;                                                         /* DDRIVER_TRACE_FUA等 */
+};
 
 #endif
\ No newline at end of file
@@ -48,7 +48,11 @@ int newfs_opendir(const char *, struct fuse_file_info *);
 char* 			   newfs_get_fname(const char* );
 int 			   newfs_calc_lvl(const char * );
 int 			   newfs_driver_read(int , uint8_t *, int );
+int 			   newfs_driver_do_write(int , uint8_t *, int , boolean );
 int 			   newfs_driver_write(int , uint8_t *, int );
+int 			   newfs_driver_write_fua(int , uint8_t *, int );
+int 			   newfs_write_block(int , uint8_t *);
+int 			   newfs_unplug();
 
 int 			   newfs_mount(struct custom_options options);
 int 			   newfs_umount();
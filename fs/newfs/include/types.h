@@ -45,6 +45,7 @@ typedef enum newfs_file_type
 #define NEWFS_MAX_FILE_NAME 128
 #define NEWFS_INODE_PER_FILE 1
 #define NEWFS_DATA_PER_FILE 6 // 一个文件有6个数据块
+#define NEWFS_PLUG_DEPTH 32   // 回写时每批提交的块数
 #define NEWFS_DEFAULT_PERM 0777
 
 #define NEWFS_IOC_MAGIC 'S'
@@ -93,6 +94,8 @@ struct newfs_super;
 struct custom_options
 {
     const char *device;
+    const char *backend; /* ddriver存储后端，NULL按设备路径推断 */
+    boolean mmap; /* 以mmap方式访问ddriver */
 };
 
 struct newfs_super
@@ -124,6 +127,7 @@ struct newfs_super
     int data_offset;
 
     boolean is_mounted;
+    boolean is_mapped; /* ddriver镜像已映射，位图直接指向映射 */
     struct newfs_dentry *root_dentry;
 };
 
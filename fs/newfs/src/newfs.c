@@ -12,6 +12,8 @@
  *******************************************************************************/
 static const struct fuse_opt option_spec[] = {/* 用于FUSE文件系统解析参数 */
                                               OPTION("--device=%s", device),
+                                              OPTION("--backend=%s", backend),
+                                              OPTION("--mmap", mmap),
                                               FUSE_OPT_END};
 
 struct custom_options newfs_options; /* 全局选项 */
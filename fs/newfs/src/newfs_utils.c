@@ -3,6 +3,10 @@
 extern struct newfs_super newfs_super;
 extern struct custom_options newfs_options;
 
+/* 回写时攒下的整块写请求，成批提交给驱动的请求队列排序、合并 */
+static struct ddriver_req newfs_plug[NEWFS_PLUG_DEPTH];
+static int newfs_plug_cnt = 0;
+
 char *newfs_get_fname(const char *path)
 {
     char ch = '/';
@@ -31,42 +35,114 @@ int newfs_driver_read(int offset, uint8_t *out_content, int size)
     int bias = offset - offset_aligned;
     int size_aligned = NEWFS_ROUND_UP((size + bias), NEWFS_BLOCK_SZ());
 
+    if (newfs_super.is_mapped)
+    {
+        uint8_t *src = (uint8_t *)ddriver_map_read(NEWFS_DRIVER(), size_aligned / NEWFS_IO_SZ(),
+                                                   offset_aligned);
+        if (src == NULL)
+            return -NEWFS_ERROR_IO;
+        memcpy(out_content, src + bias, size);
+        return NEWFS_ERROR_NONE;
+    }
+
     uint8_t *temp_content = (uint8_t *)malloc(size_aligned);
-    uint8_t *cur = temp_content;
 
-    ddriver_seek(NEWFS_DRIVER(), offset_aligned, SEEK_SET);
-    while (size_aligned != 0)
+    if (ddriver_pread(NEWFS_DRIVER(), (char *)temp_content, size_aligned / NEWFS_IO_SZ(),
+                      offset_aligned) != size_aligned)
     {
-        ddriver_read(NEWFS_DRIVER(), cur, NEWFS_IO_SZ());
-        cur += NEWFS_IO_SZ();
-        size_aligned -= NEWFS_IO_SZ();
+        free(temp_content);
+        return -NEWFS_ERROR_IO;
     }
     memcpy(out_content, temp_content + bias, size);
     free(temp_content);
     return NEWFS_ERROR_NONE;
 }
 
-int newfs_driver_write(int offset, uint8_t *in_content, int size)
+int newfs_driver_do_write(int offset, uint8_t *in_content, int size, boolean fua)
 {
     int offset_aligned = NEWFS_ROUND_DOWN(offset, NEWFS_BLOCK_SZ());
     int bias = offset - offset_aligned;
     int size_aligned = NEWFS_ROUND_UP((size + bias), NEWFS_BLOCK_SZ());
 
+    if (newfs_super.is_mapped)
+    {
+        uint8_t *dst = (uint8_t *)ddriver_map_write(NEWFS_DRIVER(), size_aligned / NEWFS_IO_SZ(),
+                                                    offset_aligned);
+        if (dst == NULL)
+            return -NEWFS_ERROR_IO;
+        memmove(dst + bias, in_content, size); /* in_content可能就在映射中 */
+        if (fua && ddriver_flush(NEWFS_DRIVER()) != 0)
+            return -NEWFS_ERROR_IO;
+        return NEWFS_ERROR_NONE;
+    }
+
     uint8_t *temp_content = (uint8_t *)malloc(size_aligned);
-    uint8_t *cur = temp_content;
+    int ret = NEWFS_ERROR_NONE;
 
     newfs_driver_read(offset_aligned, temp_content, size_aligned);
     memcpy(temp_content + bias, in_content, size);
 
-    ddriver_seek(NEWFS_DRIVER(), offset_aligned, SEEK_SET);
-    while (size_aligned != 0)
+    if ((fua ? ddriver_pwrite_fua : ddriver_pwrite)(NEWFS_DRIVER(), (char *)temp_content,
+                                                    size_aligned / NEWFS_IO_SZ(),
+                                                    offset_aligned) != size_aligned)
+        ret = -NEWFS_ERROR_IO;
+
+    free(temp_content);
+    return ret;
+}
+
+int newfs_driver_write(int offset, uint8_t *in_content, int size)
+{
+    return newfs_driver_do_write(offset, in_content, size, FALSE);
+}
+
+/* 返回时数据已落盘（FUA），用于超级块这类提交点 */
+int newfs_driver_write_fua(int offset, uint8_t *in_content, int size)
+{
+    return newfs_driver_do_write(offset, in_content, size, TRUE);
+}
+
+int newfs_unplug()
+{
+    struct ddriver_cqe cqes[NEWFS_PLUG_DEPTH];
+    int nr = newfs_plug_cnt;
+    int submitted, ret = NEWFS_ERROR_NONE;
+
+    if (nr == 0)
+        return NEWFS_ERROR_NONE;
+    newfs_plug_cnt = 0;
+
+    submitted = ddriver_submit(NEWFS_DRIVER(), newfs_plug, nr);
+    if (submitted != nr)
+        ret = -NEWFS_ERROR_IO;
+    if (submitted > 0 && ddriver_reap(NEWFS_DRIVER(), cqes, submitted, submitted) != submitted)
+        ret = -NEWFS_ERROR_IO;
+    for (int i = 0; i < submitted; i++)
     {
-        ddriver_write(NEWFS_DRIVER(), cur, NEWFS_IO_SZ());
-        cur += NEWFS_IO_SZ();
-        size_aligned -= NEWFS_IO_SZ();
+        if (cqes[i].res != NEWFS_BLOCK_SZ())
+            ret = -NEWFS_ERROR_IO;
     }
+    for (int i = 0; i < nr; i++)
+        free(newfs_plug[i].buf); /* 请求完成前缓冲不能释放 */
+    return ret;
+}
 
-    free(temp_content);
+int newfs_write_block(int offset, uint8_t *in_content)
+{
+    struct ddriver_req *req;
+
+    if (newfs_super.is_mapped)
+        return newfs_driver_write(offset, in_content, NEWFS_BLOCK_SZ());
+
+    if (newfs_plug_cnt == NEWFS_PLUG_DEPTH && newfs_unplug() != NEWFS_ERROR_NONE)
+        return -NEWFS_ERROR_IO;
+    req = &newfs_plug[newfs_plug_cnt];
+    req->op = DDRIVER_OP_WRITE;
+    req->buf = (char *)malloc(NEWFS_BLOCK_SZ());
+    req->nblocks = NEWFS_BLOCK_SZ() / NEWFS_IO_SZ();
+    req->offset = offset;
+    req->tag = newfs_plug_cnt++;
+    memcpy(req->buf, in_content, NEWFS_BLOCK_SZ());
     return NEWFS_ERROR_NONE;
 }
 
@@ -190,12 +266,15 @@ struct newfs_inode *newfs_alloc_inode(struct newfs_dentry *dentry)
     return inode;
 }
 
+/* 整块回写inode及其数据块，写请求可能仍攒在newfs_plug中，调用者须再调用newfs_unplug */
 int newfs_sync_inode(struct newfs_inode *inode)
 {
     struct newfs_inode_d inode_d;
     struct newfs_dentry *dentry_cursor;
-    struct newfs_dentry_d dentry_d;
+    struct newfs_dentry_d *dentry_d;
     int ino = inode->ino;
+    int ret = NEWFS_ERROR_NONE;
+    uint8_t *blk = (uint8_t *)calloc(1, NEWFS_BLOCK_SZ());
 
     inode_d.ino = ino;
     inode_d.size = inode->size;
@@ -207,43 +286,52 @@ int newfs_sync_inode(struct newfs_inode *inode)
         inode_d.block_pointer[i] = inode->block_pointer[i];
     }
 
-    if (newfs_driver_write(NEWFS_INO_OFS(ino), (uint8_t *)&inode_d, sizeof(struct newfs_inode_d)) != NEWFS_ERROR_NONE)
-        return -NEWFS_ERROR_IO;
+    memcpy(blk, &inode_d, sizeof(struct newfs_inode_d)); /* 每个inode独占一块，无需先读 */
+    if (newfs_write_block(NEWFS_INO_OFS(ino), blk) != NEWFS_ERROR_NONE)
+        ret = -NEWFS_ERROR_IO;
 
-    if (NEWFS_IS_DIR(inode))
+    if (ret == NEWFS_ERROR_NONE && NEWFS_IS_DIR(inode))
     {
         dentry_cursor = inode->dentrys;
         int i = 0;
         while ((dentry_cursor != NULL) && (i < inode->block_allocted))
         {
-            int offset = NEWFS_DATA_OFS(inode->block_pointer[i]);
             int current_dentry_cnt = 0;
+            memset(blk, 0, NEWFS_BLOCK_SZ());
+            dentry_d = (struct newfs_dentry_d *)blk;
             while ((dentry_cursor != NULL) && (current_dentry_cnt < NEWFS_DENTRY_PER_BLK()))
             {
-                memcpy(dentry_d.fname, dentry_cursor->fname, NEWFS_MAX_FILE_NAME);
-                dentry_d.ftype = dentry_cursor->ftype;
-                dentry_d.ino = dentry_cursor->ino;
-                if (newfs_driver_write(offset, (uint8_t *)&dentry_d, sizeof(struct newfs_dentry_d)) != NEWFS_ERROR_NONE)
-                    return -NEWFS_ERROR_IO;
+                memcpy(dentry_d->fname, dentry_cursor->fname, NEWFS_MAX_FILE_NAME);
+                dentry_d->ftype = dentry_cursor->ftype;
+                dentry_d->ino = dentry_cursor->ino;
 
-                newfs_sync_inode(dentry_cursor->inode);
+                if (dentry_cursor->inode != NULL) /* 未读入内存的inode在磁盘上没有变化 */
+                    newfs_sync_inode(dentry_cursor->inode);
                 dentry_cursor = dentry_cursor->brother;
-                offset += sizeof(struct newfs_dentry_d);
+                dentry_d++;
                 current_dentry_cnt++;
             }
+            if (newfs_write_block(NEWFS_DATA_OFS(inode->block_pointer[i]), blk) != NEWFS_ERROR_NONE)
+            {
+                ret = -NEWFS_ERROR_IO;
+                break;
+            }
             i++;
         }
     }
-    else if (NEWFS_IS_REG(inode))
+    else if (ret == NEWFS_ERROR_NONE && NEWFS_IS_REG(inode))
     {
         for (int i = 0; i < inode->block_allocted; i++)
         {
-            if (newfs_driver_write(NEWFS_DATA_OFS(inode->block_pointer[i]),
-                                   inode->data[i], NEWFS_BLOCK_SZ()) != NEWFS_ERROR_NONE)
-                return -NEWFS_ERROR_IO;
+            if (newfs_write_block(NEWFS_DATA_OFS(inode->block_pointer[i]), inode->data[i]) != NEWFS_ERROR_NONE)
+            {
+                ret = -NEWFS_ERROR_IO;
+                break;
+            }
         }
     }
-    return NEWFS_ERROR_NONE;
+    free(blk);
+    return ret;
 }
 
 int newfs_drop_inode(struct newfs_inode *inode)
@@ -310,6 +398,73 @@ int newfs_drop_inode(struct newfs_inode *inode)
     return NEWFS_ERROR_NONE;
 }
 
+/* 异步读出文件的全部数据块，设备延迟相互重叠。出错后不再提交，但仍收割完已提交的请求，
+   返回时没有请求还在使用inode->data */
+static int newfs_read_data(struct newfs_inode *inode)
+{
+    struct ddriver_req reqs[NEWFS_DATA_PER_FILE];
+    struct ddriver_cqe cqes[NEWFS_DATA_PER_FILE];
+    int nr = inode->block_allocted;
+    int submitted = 0, inflight = 0;
+    int ret = NEWFS_ERROR_NONE;
+    int cnt;
+
+    for (int i = 0; i < nr; i++)
+    {
+        inode->data[i] = (uint8_t *)malloc(NEWFS_BLOCK_SZ());
+        reqs[i].op = DDRIVER_OP_READ;
+        reqs[i].buf = (char *)inode->data[i];
+        reqs[i].nblocks = NEWFS_BLOCK_SZ() / NEWFS_IO_SZ();
+        reqs[i].offset = NEWFS_DATA_OFS(inode->block_pointer[i]);
+        reqs[i].tag = (uintptr_t)inode->data[i]; /* 和写回队列等其他调用者的标签不重复 */
+    }
+    while (submitted < nr || inflight > 0)
+    {
+        if (submitted < nr && ret == NEWFS_ERROR_NONE)
+        {
+            cnt = ddriver_submit(NEWFS_DRIVER(), reqs + submitted, nr - submitted);
+            if (cnt < 0 || (cnt == 0 && inflight == 0))
+                ret = -NEWFS_ERROR_IO;
+            else
+            {
+                submitted += cnt;
+                inflight += cnt;
+            }
+        }
+        if (inflight == 0)
+            break;
+        /* 队列满时先收割一个腾出位置，再提交剩下的 */
+        cnt = ddriver_reap(NEWFS_DRIVER(), cqes, inflight,
+                           (submitted == nr || ret != NEWFS_ERROR_NONE) ? inflight : 1);
+        if (cnt < 0)
+            return -NEWFS_ERROR_IO; /* 设备已不可用，不会再有完成项 */
+        for (int i = 0; i < cnt; i++)
+        {
+            if (cqes[i].res != NEWFS_BLOCK_SZ())
+                ret = -NEWFS_ERROR_IO;
+        }
+        inflight -= cnt;
+    }
+    return ret;
+}
+
+/* 释放读到一半的inode，子目录项此时还没有读入inode */
+static void newfs_free_inode(struct newfs_inode *inode)
+{
+    struct newfs_dentry *dentry_cursor = inode->dentrys;
+    struct newfs_dentry *next;
+
+    while (dentry_cursor)
+    {
+        next = dentry_cursor->brother;
+        free(dentry_cursor);
+        dentry_cursor = next;
+    }
+    for (int i = 0; i < NEWFS_DATA_PER_FILE; i++)
+        free(inode->data[i]);
+    free(inode);
+}
+
 struct newfs_inode *newfs_read_inode(struct newfs_dentry *dentry, int ino)
 {
     struct newfs_inode *inode = (struct newfs_inode *)malloc(sizeof(struct newfs_inode));
@@ -319,7 +474,10 @@ struct newfs_inode *newfs_read_inode(struct newfs_dentry *dentry, int ino)
     struct newfs_dentry_d dentry_d;
 
     if (newfs_driver_read(NEWFS_INO_OFS(ino), (uint8_t *)&inode_d, sizeof(struct newfs_inode_d)) != NEWFS_ERROR_NONE)
+    {
+        free(inode);
         return NULL;
+    }
 
     inode->ino = inode_d.ino;
     inode->size = inode_d.size;
@@ -341,7 +499,10 @@ struct newfs_inode *newfs_read_inode(struct newfs_dentry *dentry, int ino)
             while ((dir_cnt > 0) && (cnt < NEWFS_DENTRY_PER_BLK()))
             {
                 if (newfs_driver_read(offset, (uint8_t *)&dentry_d, sizeof(struct newfs_dentry_d)) != NEWFS_ERROR_NONE)
+                {
+                    newfs_free_inode(inode);
                     return NULL;
+                }
                 sub_dentry = new_dentry(dentry_d.fname, dentry_d.ftype);
                 sub_dentry->parent = inode->dentry;
                 sub_dentry->ino = dentry_d.ino;
@@ -353,15 +514,10 @@ struct newfs_inode *newfs_read_inode(struct newfs_dentry *dentry, int ino)
             i++;
         }
     }
-    else
+    else if (newfs_read_data(inode) != NEWFS_ERROR_NONE)
     {
-        for (int i = 0; i < inode->block_allocted; i++)
-        {
-            inode->data[i] = (uint8_t *)malloc(NEWFS_BLOCK_SZ());
-            if (newfs_driver_read(NEWFS_DATA_OFS(inode->block_pointer[i]), (uint8_t *)inode->data[i],
-                                  NEWFS_BLOCK_SZ()) != NEWFS_ERROR_NONE)
-                return NULL;
-        }
+        newfs_free_inode(inode);
+        return NULL;
     }
     return inode;
 }
@@ -455,6 +611,7 @@ int newfs_mount(struct custom_options options)
 {
     int ret = NEWFS_ERROR_NONE;
     int driver_fd;
+    struct ddriver_options driver_opts;
     struct newfs_super_d newfs_super_d;
     struct newfs_dentry *root_dentry;
     struct newfs_inode *root_inode;
@@ -468,12 +625,17 @@ int newfs_mount(struct custom_options options)
     boolean is_init = FALSE;
 
     newfs_super.is_mounted = FALSE;
+    newfs_super.is_mapped = FALSE;
 
-    driver_fd = ddriver_open((char *)options.device);
+    memset(&driver_opts, 0, sizeof(struct ddriver_options));
+    driver_opts.backend = options.backend; /* file, direct, mmap, ram, kernel */
+    driver_fd = ddriver_open_opts((char *)options.device, &driver_opts);
     if (driver_fd < 0)
         return driver_fd;
 
     newfs_super.fd = driver_fd;
+    if (options.mmap && ddriver_mmap(driver_fd) == 0)
+        newfs_super.is_mapped = TRUE;
     ddriver_ioctl(NEWFS_DRIVER(), IOC_REQ_DEVICE_SIZE, &newfs_super.sz_disk);
     ddriver_ioctl(NEWFS_DRIVER(), IOC_REQ_DEVICE_IO_SZ, &newfs_super.sz_io);
     newfs_super.sz_block = 2 * newfs_super.sz_io;
@@ -508,27 +670,42 @@ int newfs_mount(struct custom_options options)
     }
 
     newfs_super.sz_usage = newfs_super_d.sz_usage;
-    newfs_super.map_inode = (uint8_t *)malloc(newfs_super.sz_block);
     newfs_super.map_inode_offset = newfs_super_d.map_inode_offset;
     newfs_super.map_inode_blks = newfs_super_d.map_inode_blks;
 
-    newfs_super.map_data = (uint8_t *)malloc(newfs_super.sz_block);
     newfs_super.map_data_offset = newfs_super_d.map_data_offset;
     newfs_super.map_data_blks = newfs_super_d.map_data_blks;
 
     newfs_super.inode_offset = newfs_super_d.inode_offset;
     newfs_super.data_offset = newfs_super_d.data_offset;
 
-    if (newfs_driver_read(newfs_super_d.map_inode_offset, (uint8_t *)(newfs_super.map_inode), newfs_super.sz_block) != NEWFS_ERROR_NONE)
-        return -NEWFS_ERROR_IO;
+    if (newfs_super.is_mapped)
+    {
+        /* 位图直接使用映射中的块，不再拷贝 */
+        newfs_super.map_inode = (uint8_t *)ddriver_map_read(NEWFS_DRIVER(), newfs_super.sz_block / NEWFS_IO_SZ(),
+                                                            newfs_super_d.map_inode_offset);
+        newfs_super.map_data = (uint8_t *)ddriver_map_read(NEWFS_DRIVER(), newfs_super.sz_block / NEWFS_IO_SZ(),
+                                                           newfs_super_d.map_data_offset);
+        if (newfs_super.map_inode == NULL || newfs_super.map_data == NULL)
+            return -NEWFS_ERROR_IO;
+    }
+    else
+    {
+        newfs_super.map_inode = (uint8_t *)malloc(newfs_super.sz_block);
+        newfs_super.map_data = (uint8_t *)malloc(newfs_super.sz_block);
 
-    if (newfs_driver_read(newfs_super_d.map_data_offset, (uint8_t *)(newfs_super.map_data), newfs_super.sz_block) != NEWFS_ERROR_NONE)
-        return -NEWFS_ERROR_IO;
+        if (newfs_driver_read(newfs_super_d.map_inode_offset, (uint8_t *)(newfs_super.map_inode), newfs_super.sz_block) != NEWFS_ERROR_NONE)
+            return -NEWFS_ERROR_IO;
+
+        if (newfs_driver_read(newfs_super_d.map_data_offset, (uint8_t *)(newfs_super.map_data), newfs_super.sz_block) != NEWFS_ERROR_NONE)
+            return -NEWFS_ERROR_IO;
+    }
 
     if (is_init)
     {
         root_inode = newfs_alloc_inode(root_dentry);
         newfs_sync_inode(root_inode);
+        newfs_unplug();
     }
 
     root_inode = newfs_read_inode(root_dentry, NEWFS_ROOT_INO);
@@ -545,7 +722,11 @@ int newfs_umount()
     if (!newfs_super.is_mounted)
         return NEWFS_ERROR_NONE;
 
+    int sched = DDRIVER_SCHED_DEADLINE; /* 散布的inode与目录项块按C-LOOK顺序回写，相邻块合并 */
+    ddriver_ioctl(NEWFS_DRIVER(), IOC_REQ_DEVICE_SCHED, &sched);
     newfs_sync_inode(newfs_super.root_dentry->inode);
+    if (newfs_unplug() != NEWFS_ERROR_NONE)
+        return -NEWFS_ERROR_IO;
 
     newfs_super_d.magic_num = NEWFS_MAGIC_NUM;
     newfs_super_d.sz_usage = newfs_super.sz_usage;
@@ -556,17 +737,24 @@ int newfs_umount()
     newfs_super_d.map_data_offset = newfs_super.map_data_offset;
     newfs_super_d.data_offset = newfs_super.data_offset;
 
-    if (newfs_driver_write(NEWFS_SUPER_OFS, (uint8_t *)&newfs_super_d, sizeof(struct newfs_super_d)) != NEWFS_ERROR_NONE)
-        return -NEWFS_ERROR_IO;
-
     if (newfs_driver_write(newfs_super_d.map_inode_offset, (uint8_t *)(newfs_super.map_inode), newfs_super.sz_block) != NEWFS_ERROR_NONE)
         return -NEWFS_ERROR_IO;
 
     if (newfs_driver_write(newfs_super_d.map_data_offset, (uint8_t *)(newfs_super.map_data), newfs_super.sz_block) != NEWFS_ERROR_NONE)
         return -NEWFS_ERROR_IO;
 
-    free(newfs_super.map_inode);
-    free(newfs_super.map_data);
+    /* 超级块是最后的提交点：其余元数据须先落盘，超级块本身FUA写入 */
+    if (ddriver_flush(NEWFS_DRIVER()) != 0)
+        return -NEWFS_ERROR_IO;
+
+    if (newfs_driver_write_fua(NEWFS_SUPER_OFS, (uint8_t *)&newfs_super_d, sizeof(struct newfs_super_d)) != NEWFS_ERROR_NONE)
+        return -NEWFS_ERROR_IO;
+
+    if (!newfs_super.is_mapped)
+    {
+        free(newfs_super.map_inode);
+        free(newfs_super.map_data);
+    }
 
     ddriver_close(NEWFS_DRIVER());
     return NEWFS_ERROR_NONE;
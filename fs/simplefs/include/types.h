@@ -76,6 +76,7 @@ struct sfs_super;
 
 struct custom_options {
 	const char*        device;
+	const char*        backend;
 	boolean            show_help;
 };
 
@@ -14,6 +14,7 @@ struct custom_options sfs_options;
 *******************************************************************************/
 static const struct fuse_opt option_spec[] = {
 	OPTION("--device=%s", device),
+	OPTION("--backend=%s", backend),
 	OPTION("-h", show_help),
 	OPTION("--help", show_help),
 	FUSE_OPT_END
@@ -505,8 +506,9 @@ void sfs_usage() {
 	printf("Author: Deadpool <deadpoolmine@qq.com>\n");
 	printf("Description: A Filesystem in UserSpacE (FUSE) sample file system \n");
 	printf("\n");
-	printf("Usage: ./sfs-fuse --device=[device path] mntpoint\n");
+	printf("Usage: ./sfs-fuse --device=[device path] [--backend=[backend]] mntpoint\n");
 	printf("mount device to mntpoint with SFS\n");
+	printf("backend: file, direct, mmap, ram, kernel (default: by device path)\n");
 	printf("=================================================================\n");
 	printf("FUSE general options\n");
 	return;
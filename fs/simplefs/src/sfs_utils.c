@@ -50,49 +50,65 @@ int sfs_driver_read(int offset, uint8_t *out_content, int size) {
     int      bias           = offset - offset_aligned;
     int      size_aligned   = SFS_ROUND_UP((size + bias), SFS_IO_SZ());
     uint8_t* temp_content   = (uint8_t*)malloc(size_aligned);
-    uint8_t* cur            = temp_content;
     // lseek(SFS_DRIVER(), offset_aligned, SEEK_SET);
-    ddriver_seek(SFS_DRIVER(), offset_aligned, SEEK_SET);
-    while (size_aligned != 0)
-    {
-        // read(SFS_DRIVER(), cur, SFS_IO_SZ());
-        ddriver_read(SFS_DRIVER(), cur, SFS_IO_SZ());
-        cur          += SFS_IO_SZ();
-        size_aligned -= SFS_IO_SZ();   
+    if (ddriver_pread(SFS_DRIVER(), (char *)temp_content, size_aligned / SFS_IO_SZ(), 
+                      offset_aligned) != size_aligned) {
+        free(temp_content);
+        return -SFS_ERROR_IO;
     }
     memcpy(out_content, temp_content + bias, size);
     free(temp_content);
     return SFS_ERROR_NONE;
 }
 /**
- * @brief 驱动写
+ * @brief 驱动写，fua为TRUE时绕过设备写缓存直达介质
  * 
  * @param offset 
  * @param in_content 
  * @param size 
+ * @param fua 
  * @return int 
  */
-int sfs_driver_write(int offset, uint8_t *in_content, int size) {
+int sfs_driver_do_write(int offset, uint8_t *in_content, int size, boolean fua) {
     int      offset_aligned = SFS_ROUND_DOWN(offset, SFS_IO_SZ());
     int      bias           = offset - offset_aligned;
     int      size_aligned   = SFS_ROUND_UP((size + bias), SFS_IO_SZ());
     uint8_t* temp_content   = (uint8_t*)malloc(size_aligned);
-    uint8_t* cur            = temp_content;
+    int      ret            = SFS_ERROR_NONE;
     sfs_driver_read(offset_aligned, temp_content, size_aligned);
     memcpy(temp_content + bias, in_content, size);
     
     // lseek(SFS_DRIVER(), offset_aligned, SEEK_SET);
-    ddriver_seek(SFS_DRIVER(), offset_aligned, SEEK_SET);
-    while (size_aligned != 0)
-    {
-        // write(SFS_DRIVER(), cur, SFS_IO_SZ());
-        ddriver_write(SFS_DRIVER(), cur, SFS_IO_SZ());
-        cur          += SFS_IO_SZ();
-        size_aligned -= SFS_IO_SZ();   
+    if ((fua ? ddriver_pwrite_fua : ddriver_pwrite)(SFS_DRIVER(), (char *)temp_content, 
+                                                    size_aligned / SFS_IO_SZ(), 
+                                                    offset_aligned) != size_aligned) {
+        ret = -SFS_ERROR_IO;
     }
 
     free(temp_content);
-    return SFS_ERROR_NONE;
+    return ret;
+}
+/**
+ * @brief 驱动写
+ * 
+ * @param offset 
+ * @param in_content 
+ * @param size 
+ * @return int 
+ */
+int sfs_driver_write(int offset, uint8_t *in_content, int size) {
+    return sfs_driver_do_write(offset, in_content, size, FALSE);
+}
+/**
+ * @brief 驱动写，返回时数据已落盘，用于超级块这类提交点
+ * 
+ * @param offset 
+ * @param in_content 
+ * @param size 
+ * @return int 
+ */
+int sfs_driver_write_fua(int offset, uint8_t *in_content, int size) {
+    return sfs_driver_do_write(offset, in_content, size, TRUE);
 }
 /**
  * @brief 将denry插入到inode中，采用头插法
@@ -289,10 +305,15 @@ int sfs_drop_inode(struct sfs_inode * inode) {
     int bit_cursor  = 0; 
     int ino_cursor  = 0;
     boolean is_find = FALSE;
+    struct ddriver_discard discard;
 
     if (inode == sfs_super.root_dentry->inode) {
         return SFS_ERROR_INVAL;
     }
+                                                      /* 数据块不再使用，通知设备丢弃 */
+    discard.offset = SFS_DATA_OFS(inode->ino);
+    discard.len    = SFS_BLKS_SZ(SFS_DATA_PER_FILE);
+    ddriver_ioctl(SFS_DRIVER(), IOC_REQ_DEVICE_DISCARD, &discard);
 
     if (SFS_IS_DIR(inode)) {
         dentry_cursor = inode->dentrys;
@@ -524,6 +545,7 @@ struct sfs_dentry* sfs_lookup(const char * path, boolean* is_find, boolean* is_r
 int sfs_mount(struct custom_options options){
     int                 ret = SFS_ERROR_NONE;
     int                 driver_fd;
+    struct ddriver_options driver_opts;
     struct sfs_super_d  sfs_super_d; 
     struct sfs_dentry*  root_dentry;
     struct sfs_inode*   root_inode;
@@ -537,7 +559,9 @@ int sfs_mount(struct custom_options options){
     sfs_super.is_mounted = FALSE;
 
     // driver_fd = open(options.device, O_RDWR);
-    driver_fd = ddriver_open(options.device);
+    memset(&driver_opts, 0, sizeof(struct ddriver_options));
+    driver_opts.backend = options.backend;
+    driver_fd = ddriver_open_opts((char *)options.device, &driver_opts);
 
     if (driver_fd < 0) {
         return driver_fd;
@@ -620,13 +644,17 @@ int sfs_umount() {
     sfs_super_d.data_offset         = sfs_super.data_offset;
     sfs_super_d.sz_usage            = sfs_super.sz_usage;
 
-    if (sfs_driver_write(SFS_SUPER_OFS, (uint8_t *)&sfs_super_d, 
-                     sizeof(struct sfs_super_d)) != SFS_ERROR_NONE) {
+    if (sfs_driver_write(sfs_super_d.map_inode_offset, (uint8_t *)(sfs_super.map_inode), 
+                         SFS_BLKS_SZ(sfs_super_d.map_inode_blks)) != SFS_ERROR_NONE) {
         return -SFS_ERROR_IO;
     }
 
-    if (sfs_driver_write(sfs_super_d.map_inode_offset, (uint8_t *)(sfs_super.map_inode), 
-                         SFS_BLKS_SZ(sfs_super_d.map_inode_blks)) != SFS_ERROR_NONE) {
+    if (ddriver_flush(SFS_DRIVER()) != 0) {           /* 超级块落盘前，其余元数据须已落盘 */
+        return -SFS_ERROR_IO;
+    }
+
+    if (sfs_driver_write_fua(SFS_SUPER_OFS, (uint8_t *)&sfs_super_d, 
+                             sizeof(struct sfs_super_d)) != SFS_ERROR_NONE) {
         return -SFS_ERROR_IO;
     }
 